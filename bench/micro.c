@@ -0,0 +1,207 @@
+/* See LICENSE for licence details. */
+/*
+ * Microbenchmarks for the hot primitives of the emulator core.
+ *
+ * st.c is included directly so that its static functions can be called.
+ * Inputs come from a fixed seed and every benchmark runs a fixed number of
+ * iterations; the best of REPEAT runs is reported, one line per case:
+ *
+ *   <name> <screen size or -> <iterations> <ns/op>
+ */
+#include "../st.c"
+
+#define REPEAT 5
+
+typedef struct {
+    int col, row;
+} Size;
+
+static Size sizes[] = { { 80, 24 }, { 200, 60 }, { 400, 120 } };
+
+static Term* term;
+static uint seed;
+static volatile long sink; /* keeps results observable */
+
+/* xorshift32, deterministic across platforms */
+static uint rnd(uint n) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % n;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, const Size* sz, long iters, double best) {
+    char size[16] = "-";
+
+    if (sz) {
+        snprintf(size, sizeof(size), "%dx%d", sz->col, sz->row);
+    }
+    printf("%-16s %-9s %10ld %12.2f\n", name, size, iters, best / iters);
+}
+
+/* Runs fn(iters) REPEAT times and returns the fastest run in ns */
+static double best(void (*fn)(long), long iters) {
+    double t, min = 0;
+    int i;
+
+    for (i = 0; i < REPEAT; i++) {
+        seed = 0x5eed1234;
+        t = now();
+        fn(iters);
+        t = now() - t;
+        if (i == 0 || t < min) {
+            min = t;
+        }
+    }
+    return min;
+}
+
+/* utf8: a fixed mix of 1 to 4 byte sequences */
+static char utf8in[4096];
+static int utf8len;
+
+static void setuputf8(void) {
+    static const long cp[] = { 'a', 0xE9, 0x430, 0x4E2D, 0x1F600 };
+    long u;
+
+    seed = 0x5eed1234;
+    utf8len = 0;
+    while (utf8len + UTF_SIZ < sizeof(utf8in)) {
+        u = cp[rnd(LEN(cp))];
+        utf8len += utf8encode(&u, utf8in + utf8len);
+    }
+}
+
+static void benchdecode(long iters) {
+    long i, u, acc = 0;
+    int off = 0;
+
+    for (i = 0; i < iters; i++) {
+        off += utf8decode(utf8in + off, &u);
+        acc += u;
+        if (off >= utf8len) {
+            off = 0;
+        }
+    }
+    sink = acc;
+}
+
+static void benchencode(long iters) {
+    char s[UTF_SIZ];
+    long i, u, acc = 0;
+
+    for (i = 0; i < iters; i++) {
+        u = 0x20 + (i & 0xFFFF);
+        acc += utf8encode(&u, s);
+    }
+    sink = acc;
+}
+
+static void benchisfull(long iters) {
+    long i, acc = 0;
+
+    for (i = 0; i < iters; i++) {
+        acc += isfullutf8(utf8in + (i & 1023), 1 + (i & 3));
+    }
+    sink = acc;
+}
+
+/* screen primitives on a terminal of the current size */
+static void benchsetchar(long iters) {
+    char c[UTF_SIZ] = "x";
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        c[0] = 'a' + (i & 15);
+        tsetchar(term, c, &term->c.attr, rnd(term->col), rnd(term->row));
+    }
+}
+
+static void benchclear(long iters) {
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        tclearregion(term, 0, 0, term->col - 1, term->row - 1);
+    }
+}
+
+static void benchscroll(long iters) {
+    long i;
+
+    for (i = 0; i < iters; i++) {
+        tscrollup(term, 0, 1);
+    }
+}
+
+/* escape sequences: a fixed set of typical CSI parameter strings */
+static const char* csis[] = {
+        "H", "1;1H", "24;80H", "K", "2J", "0m", "1;31m", "38;5;196m",
+        "38;2;255;128;0m", "?25l", "?1049h", "1;24r", "3C",
+};
+
+static void benchcsiparse(long iters) {
+    long i, acc = 0;
+    const char* s;
+
+    for (i = 0; i < iters; i++) {
+        s = csis[rnd(LEN(csis))];
+        term->csiescseq.len = strlen(s);
+        memcpy(term->csiescseq.buf, s, term->csiescseq.len);
+        term->csiescseq.priv = 0;
+        csiparse(term);
+        acc += term->csiescseq.narg + term->csiescseq.mode;
+    }
+    sink = acc;
+}
+
+static int sgrs[][6] = {
+        { 0 }, { 1, 31 }, { 38, 5, 196 }, { 48, 2, 10, 20, 30 }, { 4, 7, 27, 24, 22 }, { 39, 49 },
+};
+static int sgrlen[] = { 1, 2, 3, 5, 5, 2 };
+
+static void benchsetattr(long iters) {
+    long i;
+    int j;
+
+    for (i = 0; i < iters; i++) {
+        j = rnd(LEN(sgrs));
+        tsetattr(term, sgrs[j], sgrlen[j]);
+    }
+    sink = term->c.attr.fg;
+}
+
+int main(void) {
+    long iters;
+    uint i;
+
+    setuputf8();
+    iters = 1 << 22;
+    report("utf8decode", NULL, iters, best(benchdecode, iters));
+    report("utf8encode", NULL, iters, best(benchencode, iters));
+    report("isfullutf8", NULL, iters, best(benchisfull, iters));
+
+    term = tnew(80, 24, 7, 0, 8);
+    iters = 1 << 20;
+    report("csiparse", NULL, iters, best(benchcsiparse, iters));
+    report("tsetattr", NULL, iters, best(benchsetattr, iters));
+
+    for (i = 0; i < LEN(sizes); i++) {
+        tresize(term, sizes[i].col, sizes[i].row);
+        treset(term);
+        iters = 1 << 20;
+        report("tsetchar", &sizes[i], iters, best(benchsetchar, iters));
+        iters = (1 << 24) / (sizes[i].col * sizes[i].row);
+        report("tclearregion", &sizes[i], iters, best(benchclear, iters));
+        iters = (1 << 18) / sizes[i].row;
+        report("tscrollup", &sizes[i], iters, best(benchscroll, iters));
+    }
+
+    return 0;
+}
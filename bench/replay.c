@@ -0,0 +1,362 @@
+/* See LICENSE for licence details. */
+/*
+ * Replays byte streams through the headless emulator core and reports
+ * throughput as JSON on stdout.
+ *
+ * Without arguments a built-in corpus is synthesized from a fixed seed, so
+ * numbers are comparable between builds. Recorded pty streams (e.g. from
+ * script(1)) can be given as file arguments instead.
+ *
+ * Each stream is replayed in a child of its own, so its peak RSS is not
+ * that of the streams before it.
+ */
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "arg.h"
+#include "helpers.h"
+#include "libsuckterm.h"
+
+#define FEED_SIZ 4096 /* a typical pty read */
+
+typedef struct {
+    char* s;
+    size_t len, size;
+} Buf;
+
+typedef struct {
+    const char* name;
+    void (*gen)(Buf*, size_t);
+} Corpus;
+
+static void genascii(Buf*, size_t);
+static void gencompiler(Buf*, size_t);
+static void genutf8(Buf*, size_t);
+static void genvim(Buf*, size_t);
+static void genhtop(Buf*, size_t);
+static void gentruecolor(Buf*, size_t);
+
+static Corpus corpora[] = {
+        { "ascii", genascii },
+        { "compiler", gencompiler },
+        { "utf8-cjk", genutf8 },
+        { "vim-scroll", genvim },
+        { "htop", genhtop },
+        { "truecolor", gentruecolor },
+};
+
+char* argv0;
+static int cols = 80, rows = 24;
+static int iterations = 5;
+static size_t corpussize = 4 << 20;
+static uint seed;
+static bool first = true;
+
+/* xorshift32, deterministic across platforms */
+static uint rnd(uint n) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed % n;
+}
+
+static void bput(Buf* b, const char* s, size_t n) {
+    if (b->len + n > b->size) {
+        b->size = MAX(b->size * 2, b->len + n);
+        b->s = xrealloc(b->s, b->size);
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+}
+
+static void bprintf(Buf* b, const char* fmt, ...) {
+    char tmp[512];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+    va_end(ap);
+    bput(b, tmp, MIN(n, (int)sizeof(tmp) - 1));
+}
+
+static void bword(Buf* b) {
+    int i, n = 1 + rnd(9);
+
+    for (i = 0; i < n; i++) {
+        bprintf(b, "%c", 'a' + rnd(26));
+    }
+}
+
+/* cat of a text file */
+void genascii(Buf* b, size_t size) {
+    int x;
+
+    while (b->len < size) {
+        for (x = 0; x < cols - 10; x++) {
+            bword(b);
+            bput(b, " ", 1);
+            x += 1 + rnd(9);
+        }
+        bput(b, "\r\n", 2);
+    }
+}
+
+/* gcc diagnostics with -fdiagnostics-color */
+void gencompiler(Buf* b, size_t size) {
+    static const char* kinds[] = {
+            "\033[01;31m\033[Kerror:", "\033[01;35m\033[Kwarning:", "\033[01;36m\033[Knote:",
+    };
+    int i;
+
+    while (b->len < size) {
+        bprintf(b, "\033[01m\033[Ksrc/file%u.c:%u:%u:\033[m\033[K %s\033[m\033[K ",
+                rnd(50), 1 + rnd(2000), 1 + rnd(80), kinds[rnd(LEN(kinds))]);
+        for (i = 0; i < 6; i++) {
+            bword(b);
+            bput(b, " ", 1);
+        }
+        bprintf(b, "'\033[01m\033[K");
+        bword(b);
+        bprintf(b, "\033[m\033[K'\r\n %5u | ", 1 + rnd(2000));
+        for (i = 0; i < 5; i++) {
+            bword(b);
+            bput(b, " ", 1);
+        }
+        bprintf(b, "\r\n       | \033[01;32m\033[K^~~~~\033[m\033[K\r\n");
+    }
+}
+
+/* mixed Latin-1, Cyrillic and double width CJK text */
+void genutf8(Buf* b, size_t size) {
+    char s[UTF_SIZ];
+    long u;
+    int x, n;
+
+    while (b->len < size) {
+        for (x = 0; x < cols - 2; x += (u >= 0x1100) ? 2 : 1) {
+            switch (rnd(4)) {
+                case 0:
+                    u = 'a' + rnd(26);
+                    break;
+                case 1:
+                    u = 0xE0 + rnd(0x1F);
+                    break;
+                case 2:
+                    u = 0x430 + rnd(0x20);
+                    break;
+                default:
+                    u = 0x4E00 + rnd(0x5000);
+            }
+            n = utf8encode(&u, s);
+            bput(b, s, n);
+        }
+        bput(b, "\r\n", 2);
+    }
+}
+
+/* vim scrolling a buffer with syntax highlighting, one line at a time */
+void genvim(Buf* b, size_t size) {
+    static const int syn[] = { 33, 34, 35, 36, 32 };
+    int line = 1, x;
+
+    bprintf(b, "\033[?25l\033[H\033[2J");
+    while (b->len < size) {
+        bprintf(b, "\033[1;%dr\033[%d;1H\n\033[r\033[%d;1H\033[K", rows - 1, rows - 1, rows - 1);
+        bprintf(b, "\033[33m%4d \033[m", line++);
+        for (x = 5; x < cols - 10; x += 8) {
+            bprintf(b, "\033[%dm", syn[rnd(LEN(syn))]);
+            bword(b);
+            bprintf(b, "\033[m ");
+        }
+        bprintf(b, "\033[%d;1H\033[K\033[1m-- INSERT --\033[m\033[%d;%dH%d,1\033[%d;6H",
+                rows, rows, cols - 18, line, rows - 1);
+    }
+    bprintf(b, "\033[?25h");
+}
+
+/* htop refreshing its full screen */
+void genhtop(Buf* b, size_t size) {
+    int y, i, n;
+
+    while (b->len < size) {
+        bprintf(b, "\033[?25l\033[H");
+        for (y = 0; y < 4; y++) {
+            n = rnd(cols / 2);
+            bprintf(b, "\033[%d;3H\033[36m%d\033[39m\033[1m[\033[32m", y + 1, y);
+            for (i = 0; i < n; i++) {
+                bput(b, "|", 1);
+            }
+            bprintf(b, "\033[%dC\033[37m%4.1f%%\033[1m]\033[m", cols / 2 - n, rnd(1000) / 10.0);
+        }
+        bprintf(b, "\033[6;1H\033[30;42m  PID USER      PRI  NI  VIRT   RES  CPU%% MEM%%   TIME+  Command\033[K\033[m");
+        for (y = 7; y < rows; y++) {
+            bprintf(b, "\033[%d;1H%5u root       20   0 %5uM %5uM \033[1m%4.1f\033[m %4.1f %2u:%02u.%02u ",
+                    y, rnd(32768), rnd(4096), rnd(1024), rnd(1000) / 10.0, rnd(1000) / 10.0,
+                    rnd(60), rnd(60), rnd(100));
+            bprintf(b, "\033[1;34m/usr/bin/");
+            bword(b);
+            bprintf(b, "\033[m\033[K");
+        }
+        bprintf(b, "\033[%d;1H\033[30;46mF1\033[mHelp  \033[30;46mF10\033[mQuit\033[K", rows);
+    }
+}
+
+/* full screen 24-bit background gradients */
+void gentruecolor(Buf* b, size_t size) {
+    int x, y, frame = 0;
+
+    while (b->len < size) {
+        bprintf(b, "\033[H");
+        for (y = 0; y < rows; y++) {
+            for (x = 0; x < cols; x++) {
+                bprintf(b, "\033[48;2;%d;%d;%dm\033[38;2;%d;%d;%dm%c",
+                        x * 255 / cols, y * 255 / rows, (frame * 8) & 255,
+                        255 - x * 255 / cols, 128, y * 255 / rows,
+                        (x + y + frame) % 2 ? '/' : '\\');
+            }
+            bprintf(b, "\033[m%s", y + 1 < rows ? "\r\n" : "");
+        }
+        frame++;
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Prints @s as a JSON string */
+static void jsonstr(const char* s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if ((uchar)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+static void replay(const char* name, const Buf* b) {
+    struct rusage ru;
+    Term* term;
+    double start, elapsed;
+    size_t off, n;
+    int i, status;
+    pid_t pid;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0) {
+        die("fork failed: %s\n", SERRNO);
+    }
+    if (pid > 0) {
+        if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+            die("%s: replay failed\n", name);
+        }
+        first = false;
+        return;
+    }
+
+    term = tnew(cols, rows, 7, 0, 8);
+    start = now();
+    for (i = 0; i < iterations; i++) {
+        for (off = 0; off < b->len; off += n) {
+            n = MIN(FEED_SIZ, b->len - off);
+            libsuckterm_feed(term, b->s + off, n);
+        }
+    }
+    elapsed = now() - start;
+    tfree(term);
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("%s\n    {\"name\": ", first ? "" : ",");
+    jsonstr(name);
+    printf(", \"bytes\": %zu, \"iterations\": %d, \"seconds\": %.6f, "
+            "\"mb_per_s\": %.2f, \"ns_per_byte\": %.3f, \"peak_rss_kb\": %ld}",
+            b->len, iterations, elapsed,
+            b->len * (double)iterations / elapsed / 1e6,
+            elapsed * 1e9 / (b->len * (double)iterations), ru.ru_maxrss);
+    fflush(stdout);
+    _exit(0);
+}
+
+static void readfile(Buf* b, const char* path) {
+    char tmp[BUFSIZ];
+    size_t n;
+    FILE* f;
+
+    if (!(f = fopen(path, "rb"))) {
+        die("%s: %s\n", path, SERRNO);
+    }
+    while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0) {
+        bput(b, tmp, n);
+    }
+    if (ferror(f)) {
+        die("%s: %s\n", path, SERRNO);
+    }
+    fclose(f);
+}
+
+static void usage(void) {
+    die("usage: %s [-c cols] [-r rows] [-n iterations] [-s megabytes] [file ...]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+    Buf b = { 0 };
+    uint i;
+
+    ARGBEGIN {
+        case 'c':
+            cols = atoi(EARGF(usage()));
+            break;
+        case 'r':
+            rows = atoi(EARGF(usage()));
+            break;
+        case 'n':
+            iterations = atoi(EARGF(usage()));
+            break;
+        case 's':
+            corpussize = (size_t)atoi(EARGF(usage())) << 20;
+            break;
+        default:
+            usage();
+    } ARGEND;
+
+    if (cols < 1 || rows < 1 || iterations < 1 || corpussize < 1) {
+        usage();
+    }
+
+    printf("{\"cols\": %d, \"rows\": %d, \"results\": [", cols, rows);
+    if (argc == 0) {
+        for (i = 0; i < LEN(corpora); i++) {
+            seed = 0x5eed1234;
+            b.len = 0;
+            corpora[i].gen(&b, corpussize);
+            replay(corpora[i].name, &b);
+        }
+    } else {
+        for (; argc > 0; argc--, argv++) {
+            b.len = 0;
+            readfile(&b, argv[0]);
+            replay(basename(argv[0]), &b);
+        }
+    }
+    printf("\n]}\n");
+    free(b.s);
+
+    return 0;
+}
@@ -16,13 +16,21 @@ static char shell[] = "/bin/sh";
 float cwscale = 1.0;
 float chscale = 1.0;
 
-/* frames per second st should at maximum draw to the screen */
+/*
+ * frames per second st should at maximum draw to the screen; set it to the
+ * refresh rate of the display
+ */
 static unsigned int xfps = 120;
-static unsigned int actionfps = 30;
+
+/*
+ * synchronized output (DECSET 2026) timeout in milliseconds; drawing is
+ * resumed after this even if the application never ends the update
+ */
+static unsigned int synctimeout = 150;
 
 /*
  * blinking timeout (set to 0 to disable blinking) for the terminal blinking
- * attribute.
+ * attribute and the blinking cursor.
  */
 static unsigned int blinktimeout = 800;
 
@@ -32,6 +40,16 @@ static unsigned int blinktimeout = 800;
  */
 static int bellvolume = 0;
 
+/* Internal shortcuts */
+#define MODKEY Mod1Mask
+
+static Shortcut shortcuts[] = {
+        /* mask                 keysym          function        argument */
+        { MODKEY | ShiftMask, XK_Prior, xzoom, { .i = +1 } },
+        { MODKEY | ShiftMask, XK_Next, xzoom, { .i = -1 } },
+        { MODKEY | ShiftMask, XK_Home, xzoomreset, { .i = 0 } },
+};
+
 /* TERM value */
 static char termname[] = "xterm";
 
@@ -14,14 +14,18 @@ X11LIB = /usr/X11R6/lib
 INCS = -I. -I/usr/include -I${X11INC} \
        `pkg-config --cflags fontconfig` \
        `pkg-config --cflags freetype2`
-LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 -lutil -lXext -lXft \
+LIBS = -L/usr/lib -lc -L${X11LIB} -lX11 -lutil -lXext -lXft -lXrender -lpthread \
        `pkg-config --libs fontconfig`  \
        `pkg-config --libs freetype2`
+# the headless emulator core only needs openpty() and threads
+LIBLIBS = -L/usr/lib -lc -lutil -lpthread
 
 # flags
 CPPFLAGS = -DVERSION=\"${VERSION}\" -D_BSD_SOURCE -D_XOPEN_SOURCE=600
-CFLAGS += -g -std=c99 -pedantic -Wall -Wvariadic-macros -O0 ${INCS} ${CPPFLAGS}
+CFLAGS += -g -std=c99 -pedantic -Wall -Wvariadic-macros -O0 -fPIC ${INCS} ${CPPFLAGS}
 LDFLAGS += -g ${LIBS}
+# the benchmarks build the core from source with optimization
+BENCHCFLAGS = ${CFLAGS} -O2
 
 # compiler and linker
 CC ?= cc
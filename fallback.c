@@ -0,0 +1,223 @@
+/* See LICENSE for licence details. */
+/*
+ * Persistent cache of fallback font resolution. Finding the font for a
+ * character missing from the main font takes an FcFontSort over all fonts
+ * and an FcFontSetMatch; the file and face they picked are recorded here,
+ * so the next st process finds them right away.
+ *
+ * The cache is $XDG_CACHE_HOME/st/fallback: a Header followed by Records
+ * that are only ever appended, by any number of processes. It is mapped
+ * once at startup and started afresh when the fontconfig configuration,
+ * the font directories or the format change.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "helpers.h"
+#include "fallback.h"
+
+#define FALLBACK_VERSION 1
+#define FALLBACK_MAX     (1 << 20) /* larger caches are started afresh */
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t stamp; /* of the fontconfig setup, see fallback_stamp() */
+} Header;
+
+typedef struct {
+    uint32_t rune;
+    uint32_t font; /* hash of the font name */
+    uint16_t flags; /* style, the FRC_* of xgui.c */
+    uint16_t len; /* of the file name that follows, with its NUL */
+    int32_t index; /* face in the file */
+} Record; /* followed by the file name, padded to 4 bytes */
+
+static struct {
+    int fd;
+    uint32_t font;
+    const char* map;
+    size_t maplen;
+} cache = { .fd = -1 };
+
+/* FNV-1a */
+static uint64_t hash(uint64_t h, const void* data, size_t len) {
+    const unsigned char* p = data;
+
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t hashfiles(uint64_t h, FcStrList* list) {
+    struct stat st;
+    FcChar8* s;
+
+    if (!list) {
+        return h;
+    }
+    while ((s = FcStrListNext(list))) {
+        h = hash(h, s, strlen((char*)s));
+        if (!stat((char*)s, &st)) {
+            h = hash(h, &st.st_mtime, sizeof(st.st_mtime));
+            h = hash(h, &st.st_size, sizeof(st.st_size));
+            h = hash(h, &st.st_ino, sizeof(st.st_ino));
+        }
+    }
+    FcStrListDone(list);
+    return h;
+}
+
+/* Changes whenever fontconfig could resolve differently */
+static uint64_t fallback_stamp(void) {
+    int version = FcGetVersion();
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    h = hash(h, &version, sizeof(version));
+    h = hashfiles(h, FcConfigGetConfigFiles(NULL));
+    return hashfiles(h, FcConfigGetFontDirs(NULL));
+}
+
+static bool fallback_path(char* path, size_t size) {
+    char* dir = getenv("XDG_CACHE_HOME");
+    char* home = getenv("HOME");
+
+    if (dir && *dir) {
+        snprintf(path, size, "%s", dir);
+    } else if (home) {
+        snprintf(path, size, "%s/.cache", home);
+    } else {
+        return false;
+    }
+    mkdir(path, 0700);
+    strncat(path, "/st", size - strlen(path) - 1);
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        return false;
+    }
+    strncat(path, "/fallback", size - strlen(path) - 1);
+    return true;
+}
+
+/* Replaces the cache with an empty one; mappings of the old one stay valid */
+static int fallback_create(const char* path, const Header* h) {
+    char tmp[4096 + 16];
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600)) < 0) {
+        return -1;
+    }
+    if (write(fd, h, sizeof(*h)) != sizeof(*h) || rename(tmp, path) < 0) {
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    return fd;
+}
+
+/* Maps the cache for the font @fontname; without it everything is resolved anew */
+void fallback_open(const char* fontname) {
+    Header want = { { 's', 't', 'F', 'B' }, FALLBACK_VERSION, fallback_stamp() }, have;
+    char path[4096];
+    struct stat st;
+    void* map;
+
+    cache.font = hash(0xcbf29ce484222325ULL, fontname, strlen(fontname));
+    if (!fallback_path(path, sizeof(path))
+            || (cache.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0
+            || fstat(cache.fd, &st) < 0) {
+        return;
+    }
+
+    if (st.st_size < sizeof(have) || st.st_size > FALLBACK_MAX
+            || pread(cache.fd, &have, sizeof(have), 0) != sizeof(have)
+            || memcmp(&have, &want, sizeof(have))) {
+        close(cache.fd);
+        cache.fd = fallback_create(path, &want);
+        return;
+    }
+
+    if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache.fd, 0)) != MAP_FAILED) {
+        cache.map = map;
+        cache.maplen = st.st_size;
+    }
+}
+
+static const Record* fallback_lookup(long u, int flags) {
+    const char* p = cache.map + sizeof(Header), * end = cache.map + cache.maplen;
+    const Record* r;
+
+    if (!cache.map) {
+        return NULL;
+    }
+    for (; p + sizeof(Record) <= end; p += sizeof(Record) + ((r->len + 3) & ~3)) {
+        r = (const Record*)p;
+        if (p + sizeof(Record) + r->len > end) {
+            break;
+        }
+        if (r->rune == u && r->font == cache.font && r->flags == flags
+                && r->len > 0 && p[sizeof(Record) + r->len - 1] == '\0') {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns what FcFontSetMatch would for @pattern, which asks for @u in the
+ * style @flags, if the cache knows the font; NULL otherwise.
+ */
+FcPattern* fallback_match(FcPattern* pattern, long u, int flags) {
+    const Record* r = fallback_lookup(u, flags);
+    const char* file;
+    FcFontSet* fonts;
+    FcChar8* f;
+    int i, index;
+
+    if (!r || !(fonts = FcConfigGetFonts(NULL, FcSetSystem))) {
+        return NULL;
+    }
+    file = (const char*)(r + 1);
+    for (i = 0; i < fonts->nfont; i++) {
+        if (FcPatternGetString(fonts->fonts[i], FC_FILE, 0, &f) != FcResultMatch
+                || strcmp((char*)f, file)
+                || FcPatternGetInteger(fonts->fonts[i], FC_INDEX, 0, &index) != FcResultMatch
+                || index != r->index) {
+            continue;
+        }
+        return FcFontRenderPrepare(NULL, pattern, fonts->fonts[i]);
+    }
+    return NULL;
+}
+
+/* Records that @match was picked for @u in the style @flags */
+void fallback_add(long u, int flags, FcPattern* match) {
+    char buf[sizeof(Record) + 4096 + 4] = { 0 };
+    Record* r = (Record*)buf;
+    FcChar8* file;
+    size_t len;
+    int index;
+
+    if (cache.fd < 0 || !match
+            || FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch
+            || FcPatternGetInteger(match, FC_INDEX, 0, &index) != FcResultMatch
+            || (len = strlen((char*)file) + 1) > 4096) {
+        return;
+    }
+
+    *r = (Record){ .rune = u, .font = cache.font, .flags = flags, .len = len, .index = index };
+    memcpy(r + 1, file, len);
+    /* one write, so that records of several processes don't interleave */
+    if (write(cache.fd, buf, sizeof(Record) + ((len + 3) & ~3)) < 0) {
+        close(cache.fd);
+        cache.fd = -1;
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef LIBSUCKTERM_FALLBACK_H
+#define LIBSUCKTERM_FALLBACK_H
+#include <fontconfig/fontconfig.h>
+
+void fallback_open(const char* fontname);
+FcPattern* fallback_match(FcPattern* pattern, long u, int flags);
+void fallback_add(long u, int flags, FcPattern* match);
+
+#endif
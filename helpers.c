@@ -33,6 +33,11 @@ void* xrealloc(void* p, size_t len) {
 
     return p;
 }
+char* xstrdup(const char* s) {
+    size_t len = strlen(s) + 1;
+
+    return memcpy(xmalloc(len), s, len);
+}
 int utf8decode(char* s, long* u) {
     uchar c;
     int i, n, rtn;
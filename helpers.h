@@ -22,6 +22,7 @@ ssize_t xwrite(int fd, const char* s, size_t len);
 
 void* xmalloc(size_t len);
 void* xrealloc(void* p, size_t len);
+char* xstrdup(const char* s);
 
 int utf8decode(char* s, long* u);
 int utf8encode(long* u, char* s);
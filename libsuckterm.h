@@ -2,6 +2,8 @@
 #define LIBSUCKTERM_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 #define UTF_SIZ       4
 
@@ -59,10 +61,109 @@ enum term_mode {
     MODE_MOUSEX10 = 131072,
     MODE_MOUSEMANY = 262144,
     MODE_BRCKTPASTE = 524288,
+    MODE_SYNC = 1048576,
     MODE_MOUSE = MODE_MOUSEBTN | MODE_MOUSEMOTION | MODE_MOUSEX10 | MODE_MOUSEMANY,
 };
 
-/* Internal representation of the screen */
+/* Arbitrary sizes */
+#define ESC_BUF_SIZ   (128*UTF_SIZ)
+#define ESC_ARG_SIZ   16
+#define STR_BUF_SIZ   ESC_BUF_SIZ
+#define STR_ARG_SIZ   ESC_ARG_SIZ
+#define TTY_BUF_SIZ   (64*1024)
+
+/* CSI Escape sequence structs */
+/* ESC '[' [[ [<priv>] <arg> [;]] <mode>] */
+typedef struct {
+    char buf[ESC_BUF_SIZ];
+    /* raw string */
+    int len;
+    /* raw string length */
+    char priv;
+    int arg[ESC_ARG_SIZ];
+    int narg;
+    /* nb of args */
+    char mode;
+} CSIEscape;
+
+/* STR Escape sequence structs */
+/* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
+typedef struct {
+    char type;
+    /* ESC type ... */
+    char buf[STR_BUF_SIZ];
+    /* raw string */
+    int len;
+    /* raw string length */
+    char* args[STR_ARG_SIZ];
+    int narg;              /* nb of args */
+} STREscape;
+
+/*
+ * What the emulator asks of its frontend. Unless a terminal has an event
+ * queue, see libsuckterm_event_queue(), it calls the matching
+ * libsuckterm_cb_* function right away instead.
+ */
+enum libsuckterm_event_type {
+    LIBSUCKTERM_EVENT_BELL,
+    LIBSUCKTERM_EVENT_TITLE,             /* str, NULL to reset it */
+    LIBSUCKTERM_EVENT_RESET_COLORS,
+    LIBSUCKTERM_EVENT_COLOR,             /* arg index, str name, NULL to reset it */
+    LIBSUCKTERM_EVENT_CURSOR_VISIBILITY, /* arg */
+    LIBSUCKTERM_EVENT_CURSOR_BLINK,      /* arg */
+    LIBSUCKTERM_EVENT_REVERSE_VIDEO,     /* arg */
+    LIBSUCKTERM_EVENT_POINTER_MOTION,    /* arg */
+    LIBSUCKTERM_EVENT_LOST,              /* arg events dropped, the queue was full */
+};
+
+typedef struct {
+    int type;
+    int arg;
+    char* str; /* the consumer's to free() */
+} TermEvent;
+
+/*
+ * Screen snapshots for readers on other threads, see libsuckterm_publish().
+ * A snapshot and its rows never change once published. A row is shared by
+ * consecutive snapshots until it is written, and ver tells the snapshot in
+ * which it last changed, so a reader only copies rows with a new ver.
+ */
+#define SNAP_READERS 8 /* readers of one terminal at a time */
+
+typedef struct {
+    unsigned refs;
+    /* snapshots sharing the row, only used by the parsing thread */
+    unsigned long ver;
+    Cell cells[];
+} SnapRow;
+
+typedef struct Snapshot Snapshot;
+struct Snapshot {
+    unsigned long ver;
+    int cols, rows;
+    int cx, cy;
+    /* cursor */
+    int mode;
+    /* enum term_mode */
+    Snapshot* next;
+    /* retired snapshots, used by the parsing thread */
+    SnapRow* row[];
+};
+
+/* A reader's copy of the screen, see libsuckterm_snapshot_copy() */
+typedef struct {
+    int cols, rows;
+    int cx, cy, mode;
+    Cell* cells;
+    /* rows * cols */
+    unsigned long* ver;
+    /* of each row, 0 for none */
+} ScreenCopy;
+
+/*
+ * A terminal. Everything the emulator knows about one terminal lives here,
+ * so a process can run any number of them; see tnew().
+ */
 typedef struct {
     int row;
     /* number of rows */
@@ -75,6 +176,8 @@ typedef struct {
     Line* alt;    /* alternate screen */
     bool* dirty;
     /* dirtyness of lines */
+    bool* changed;
+    /* lines written since the last snapshot */
     TCursor c;
     /* cursor */
     int top;
@@ -95,8 +198,67 @@ typedef struct {
     /* user default settings */
     unsigned int defaultfg, defaultbg;
     unsigned tabspaces;
+
+    CSIEscape csiescseq;
+    STREscape strescseq;
+    TCursor saved[2];
+    /* DECSC cursors of the main and alternate screen */
+
+    int cmdfd;
+    /* pty master, -1 when headless */
+    pid_t pid;
+    /* child process on the pty, -1 if it could not be started */
+    char* ttybuf;
+    /* input from the pty, TTY_BUF_SIZ bytes */
+    int ttybufpos;
+    /* start of the unparsed bytes */
+    int ttybuflen;
+    /* number of unparsed bytes */
+
+    /*
+     * Jump-scroll state. jumplen bytes from the parse position form a run
+     * of text, SGR and charset sequences only, containing jumplines line
+     * feeds. A character followed by at least a screenful of those line
+     * feeds cannot be visible once the run is parsed, so while jumping is
+     * set cells are not written and full-screen scrolls are only counted
+     * in jumpscroll.
+     */
+    int jumplen, jumplines, jumpscroll;
+    bool jumping;
+
+    /*
+     * Outbound queue: a ring buffer of bytes waiting to be written to the
+     * (non-blocking) pty. Replies and keystrokes only append to it; the
+     * frontend calls ttyflush() when the fd is writable.
+     */
+    char* wq;
+    size_t wqsize, wqhead, wqlen;
+
+    int oldbutton;
+    /* last reported mouse button, 3 = release */
+    int mouseox, mouseoy;
+    /* last reported mouse position */
+
+    /*
+     * Event queue: a ring of evsize (a power of two) events, NULL until
+     * libsuckterm_event_queue(). The parsing thread only advances evtail
+     * and the consumer only evhead; both count up and wrap freely.
+     */
+    TermEvent* ev;
+    unsigned evsize, evhead, evtail, evlost;
+
+    /*
+     * Snapshots. snap is the latest; older ones wait in retired until no
+     * reader's hazard slot points to them. readers has a bit per open slot.
+     */
+    Snapshot* snap;
+    Snapshot* retired;
+    Snapshot* hazard[SNAP_READERS];
+    unsigned readers;
+    unsigned long snapver;
+
+    void* user;   /* for the frontend, untouched by the emulator */
 } Term;
-extern Term term;
 
 #define TRUECOLOR(r, g, b) (1 << 24 | (r) << 16 | (g) << 8 | (b))
 #define IS_TRUECOL(x)    (1 << 24 & (x))
@@ -105,8 +267,7 @@ extern Term term;
 #define TRUEBLUE(x)      (((x) & 0xff) << 8)
 
 #define ATTRCMP(a, b) ((a).mode != (b).mode || (a).fg != (b).fg || (a).bg != (b).bg)
-#define IS_SET(flag) ((term.mode & (flag)) != 0)
-#define TIMEDIFF(t1, t2) ((t1.tv_sec-t2.tv_sec)*1000 + (t1.tv_usec-t2.tv_usec)/1000)
+#define IS_SET(t, flag) (((t)->mode & (flag)) != 0)
 #define CEIL(x) (((x) != (int) (x)) ? (x) + 1 : (x))
 
 enum libsuckterm_modifier {
@@ -121,33 +282,48 @@ enum libsuckterm_mouse_event {
     LIBSUCKTERM_MOUSE_MOTION,
 };
 
-void libsuckterm_cb_bell(void);
-void libsuckterm_cb_reset_title(void);
-void libsuckterm_cb_reset_colors(void);
-void libsuckterm_cb_set_cursor_visibility(bool);
-void libsuckterm_cb_set_reverse_video(bool);
-void libsuckterm_cb_set_pointer_motion(int);
-void libsuckterm_cb_set_title(char*);
-void libsuckterm_cb_set_urgency(int);
-int libsuckterm_cb_set_color(int x, const char* name);
-
-void libsuckterm_notify_focus(bool in);
-void libsuckterm_notify_set_size(int col, int row, int cw, int ch);
-void libsuckterm_notify_exit(void);
-void libsuckterm_notify_mouse_event(enum libsuckterm_mouse_event event,
+void libsuckterm_cb_bell(Term*);
+void libsuckterm_cb_reset_title(Term*);
+void libsuckterm_cb_reset_colors(Term*);
+void libsuckterm_cb_set_cursor_visibility(Term*, bool);
+void libsuckterm_cb_set_cursor_blink(Term*, bool);
+void libsuckterm_cb_set_reverse_video(Term*, bool);
+void libsuckterm_cb_set_pointer_motion(Term*, int);
+void libsuckterm_cb_set_title(Term*, char*);
+void libsuckterm_cb_set_urgency(Term*, int);
+int libsuckterm_cb_set_color(Term*, int x, const char* name);
+
+void libsuckterm_notify_focus(Term* term, bool in);
+void libsuckterm_notify_set_size(Term* term, int col, int row, int cw, int ch);
+void libsuckterm_notify_exit(Term* term);
+void libsuckterm_notify_mouse_event(Term* term, enum libsuckterm_mouse_event event,
         int x, int y, unsigned mods, int button_index);
 
-int libsuckterm_init(unsigned winid, char** cmd, char* shell, char* termname);
-static inline int libsuckterm_get_cols() { return term.col; }
-static inline int libsuckterm_get_rows() { return term.row; }
-static inline int libsuckterm_get_cursor_x() { return term.c.x; }
-static inline int libsuckterm_get_cursor_y() { return term.c.y; }
+int libsuckterm_init(Term* term, unsigned winid, char** cmd, char* shell, char* termname);
+void libsuckterm_feed(Term* term, const char* s, size_t n);
+void libsuckterm_event_queue(Term* term, unsigned size);
+bool libsuckterm_next_event(Term* term, TermEvent* ev);
+void libsuckterm_dispatch_events(Term* term);
+void libsuckterm_publish(Term* term);
+int libsuckterm_reader_open(Term* term);
+void libsuckterm_reader_close(Term* term, int reader);
+const Snapshot* libsuckterm_snapshot_acquire(Term* term, int reader);
+void libsuckterm_snapshot_release(Term* term, int reader);
+int libsuckterm_snapshot_copy(const Snapshot* s, ScreenCopy* copy);
+static inline int libsuckterm_get_cols(Term* term) { return term->col; }
+static inline int libsuckterm_get_rows(Term* term) { return term->row; }
+static inline int libsuckterm_get_cursor_x(Term* term) { return term->c.x; }
+static inline int libsuckterm_get_cursor_y(Term* term) { return term->c.y; }
 
-void tnew(int col, int row, unsigned int defaultfg, unsigned int defaultbg, unsigned int tabspaces);
-void tfulldirt(void);
+Term* tnew(int col, int row, unsigned int defaultfg, unsigned int defaultbg, unsigned int tabspaces);
+void tfree(Term*);
+void tfulldirt(Term*);
 
-void ttyread(void);
-void ttyresize(void);
-void ttysend(char*, size_t);
-void ttywrite(const char*, size_t);
+int ttyread(Term*);
+bool ttyparse(Term*, size_t);
+void ttyresize(Term*);
+void ttysend(Term*, char*, size_t);
+void ttywrite(Term*, const char*, size_t);
+size_t ttyflush(Term*);
+bool ttyblocked(Term*);
 #endif
@@ -0,0 +1,42 @@
+/* See LICENSE for licence details. */
+/*
+ * No-op frontend callbacks for running the emulator core without a display.
+ * They are weak so that a real frontend linked alongside overrides them.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include "helpers.h"
+#include "libsuckterm.h"
+
+#define WEAK __attribute__((weak))
+
+WEAK void libsuckterm_cb_bell(Term* term) {
+}
+
+WEAK void libsuckterm_cb_reset_title(Term* term) {
+}
+
+WEAK void libsuckterm_cb_reset_colors(Term* term) {
+}
+
+WEAK void libsuckterm_cb_set_cursor_visibility(Term* term, bool visible) {
+}
+
+WEAK void libsuckterm_cb_set_cursor_blink(Term* term, bool blink) {
+}
+
+WEAK void libsuckterm_cb_set_reverse_video(Term* term, bool reverse) {
+}
+
+WEAK void libsuckterm_cb_set_pointer_motion(Term* term, int motion) {
+}
+
+WEAK void libsuckterm_cb_set_title(Term* term, char* title) {
+}
+
+WEAK void libsuckterm_cb_set_urgency(Term* term, int add) {
+}
+
+WEAK int libsuckterm_cb_set_color(Term* term, int x, const char* name) {
+    return 1;
+}
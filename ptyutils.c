@@ -1,91 +1,216 @@
+#define _GNU_SOURCE /* POSIX_SPAWN_SETSID */
 #include "helpers.h"
 #include "ptyutils.h"
+#include <fcntl.h>
+#include <pthread.h>
 #include <pty.h>
 #include <pwd.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-pid_t child_pid;
+extern char** environ;
 
-void execsh(unsigned long windowid, char** cmd, char* shell, char* termname) {
-    char** args;
-    char* envshell = getenv("SHELL");
-    const struct passwd* pass = getpwuid(getuid());
-    char buf[sizeof(long) * 8 + 1];
+/*
+ * The passwd entry of the user; it is only looked up once. The lock guards
+ * the flags, as stserver workers may start shells concurrently.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    bool started, done;
+    struct passwd pw, * result;
+    char buf[16384];
+} user = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-    unsetenv("COLUMNS");
-    unsetenv("LINES");
-    unsetenv("TERMCAP");
+static void* lookupuser(void* arg) {
+    getpwuid_r(getuid(), &user.pw, user.buf, sizeof(user.buf), &user.result);
+    return NULL;
+}
 
-    if (pass) {
-        setenv("LOGNAME", pass->pw_name, 1);
-        setenv("USER", pass->pw_name, 1);
-        setenv("SHELL", pass->pw_shell, 0);
-        setenv("HOME", pass->pw_dir, 0);
+/*
+ * Starts looking up the passwd entry ttynew() needs in the background, as
+ * with NSS or LDAP that can take a while. Call it as early as possible.
+ */
+void ttyprefetchuser(void) {
+    sigset_t all, old;
+
+    pthread_mutex_lock(&user.lock);
+    if (!user.started && !user.done) {
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        user.started = !pthread_create(&user.thread, NULL, lookupuser, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
     }
+    pthread_mutex_unlock(&user.lock);
+}
 
-    snprintf(buf, sizeof(buf), "%lu", windowid);
-    setenv("WINDOWID", buf, 1);
+static const struct passwd* ttyuser(void) {
+    pthread_mutex_lock(&user.lock);
+    if (user.started) {
+        pthread_join(user.thread, NULL);
+        user.started = false;
+        user.done = true;
+    }
+    if (!user.done) {
+        lookupuser(NULL);
+        user.done = true;
+    }
+    pthread_mutex_unlock(&user.lock);
+    return user.result;
+}
 
-    signal(SIGCHLD, SIG_DFL);
-    signal(SIGHUP, SIG_DFL);
-    signal(SIGINT, SIG_DFL);
-    signal(SIGQUIT, SIG_DFL);
-    signal(SIGTERM, SIG_DFL);
-    signal(SIGALRM, SIG_DFL);
+static char* envvar(const char* name, const char* value) {
+    char* var = xmalloc(strlen(name) + strlen(value) + 2);
 
-    DEFAULT(envshell, shell);
-    setenv("TERM", termname, 1);
-    args = cmd ? cmd : (char* []){ envshell, "-i", NULL };
-    execvp(args[0], args);
-    exit(EXIT_FAILURE);
+    sprintf(var, "%s=%s", name, value);
+    return var;
 }
 
-void sigchld(int a) {
-    int st = 0;
+/*
+ * Builds the environment of the shell from ours. The first *@nkept strings
+ * are shared with environ, the ones after them are allocated.
+ */
+static char** buildenv(unsigned long windowid, char* termname, int* nkept) {
+    static const char* drop[] = { "COLUMNS", "LINES", "TERMCAP", "WINDOWID", "TERM", "LOGNAME", "USER" };
+    const struct passwd* pass = ttyuser();
+    char buf[sizeof(long) * 8 + 1];
+    int i, j, n = 0, nenv, ndrop = pass ? LEN(drop) : LEN(drop) - 2;
+    size_t len;
+    char** env;
 
-    if (waitpid(child_pid, &st, 0) < 0) {
-        die("Waiting for pid %hd failed: %s\n", child_pid, SERRNO);
+    for (nenv = 0; environ[nenv]; nenv++);
+    env = xmalloc((nenv + 7) * sizeof(*env));
+    for (i = 0; i < nenv; i++) {
+        for (j = 0; j < ndrop; j++) {
+            len = strlen(drop[j]);
+            if (!strncmp(environ[i], drop[j], len) && environ[i][len] == '=') {
+                break;
+            }
+        }
+        if (j == ndrop) {
+            env[n++] = environ[i];
+        }
+    }
+    *nkept = n;
+
+    snprintf(buf, sizeof(buf), "%lu", windowid);
+    env[n++] = envvar("WINDOWID", buf);
+    env[n++] = envvar("TERM", termname);
+    if (pass) {
+        env[n++] = envvar("LOGNAME", pass->pw_name);
+        env[n++] = envvar("USER", pass->pw_name);
+        if (!getenv("SHELL")) {
+            env[n++] = envvar("SHELL", pass->pw_shell);
+        }
+        if (!getenv("HOME")) {
+            env[n++] = envvar("HOME", pass->pw_dir);
+        }
     }
+    env[n] = NULL;
+    return env;
+}
+
+/*
+ * Returns a pidfd for @pid, which becomes readable when it exits, or -1 if
+ * the kernel has none (before Linux 5.3).
+ */
+int childfd(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/*
+ * Sends @sig to the process of pidfd @fd; unlike kill() it cannot hit an
+ * unrelated process that got the pid after the child was reaped.
+ */
+int childkill(int fd, int sig) {
+    return syscall(SYS_pidfd_send_signal, fd, sig, NULL, 0);
+}
 
-    if (WIFEXITED(st)) {
-        exit(WEXITSTATUS(st));
-    } else {
-        exit(EXIT_FAILURE);
+/* Reaps @pid if it has exited and returns its exit status, else -1 */
+int childreap(pid_t pid) {
+    pid_t r;
+    int st;
+
+    while ((r = waitpid(pid, &st, WNOHANG)) < 0 && errno == EINTR);
+    if (r == 0) {
+        return -1;
+    }
+    if (r < 0 || !WIFEXITED(st)) {
+        return EXIT_FAILURE;
     }
+    return WEXITSTATUS(st);
 }
 
-int ttynew(unsigned short row, unsigned short col, unsigned long windowid, char** cmd, char* shell, char* termname) {
-    int m, s;
+/*
+ * Starts the shell on a new pty and returns its master. The child is made
+ * with posix_spawn, which uses vfork, so the cost of starting it does not
+ * grow with our address space; everything it needs, down to the
+ * environment, is prepared here. Opening the slave by name in the new
+ * session makes it the controlling tty. If the command can't be started,
+ * *@pid is set to -1.
+ */
+int ttynew(unsigned short row, unsigned short col, unsigned long windowid, char** cmd, char* shell, char* termname,
+        pid_t* pid) {
+    static const int sigs[] = { SIGCHLD, SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGALRM, SIGPIPE };
+    posix_spawn_file_actions_t fa;
+    posix_spawnattr_t attr;
+    sigset_t sigdef, mask;
+    char* envshell = getenv("SHELL");
+    char** args, ** env;
+    char slave[64];
+    int m, s, i, nkept, err;
     struct winsize w = { row, col, 0, 0 };
 
     /* seems to work fine on linux, openbsd and freebsd */
     if (openpty(&m, &s, NULL, NULL, &w) < 0) {
         die("openpty failed: %s\n", SERRNO);
     }
+    fcntl(m, F_SETFD, FD_CLOEXEC); /* other terminals' shells need not see it */
+    fcntl(s, F_SETFD, FD_CLOEXEC);
+    /* not ptsname(): stserver starts shells from several threads */
+    if ((err = ptsname_r(m, slave, sizeof(slave)))) {
+        die("ptsname_r failed: %s\n", strerror(err));
+    }
 
-    switch (child_pid = fork()) {
-        case -1:
-            die("fork failed\n");
-            break;
-        case 0:
-            setsid(); /* create a new process group */
-            dup2(s, STDIN_FILENO);
-            dup2(s, STDOUT_FILENO);
-            dup2(s, STDERR_FILENO);
-            if (ioctl(s, TIOCSCTTY, NULL) < 0) {
-                die("ioctl TIOCSCTTY failed: %s\n", SERRNO);
-            }
-            close(s);
-            close(m);
-            execsh(windowid, cmd, shell, termname);
-            break;
-        default:
-            close(s);
-            signal(SIGCHLD, sigchld);
-            return m;
+    posix_spawn_file_actions_init(&fa);
+    posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, slave, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&fa, STDIN_FILENO, STDERR_FILENO);
+
+    sigemptyset(&sigdef);
+    for (i = 0; i < LEN(sigs); i++) {
+        sigaddset(&sigdef, sigs[i]);
+    }
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    DEFAULT(envshell, shell);
+    args = cmd ? cmd : (char* []){ envshell, "-i", NULL };
+    env = buildenv(windowid, termname, &nkept);
+
+    /* on failure the master reads EOF once the slave is closed below */
+    if ((err = posix_spawnp(pid, args[0], &fa, &attr, args, env))) {
+        fprintf(stderr, "st: can't run %s: %s\n", args[0], strerror(err));
+        *pid = -1;
+    }
+
+    for (i = nkept; env[i]; i++) {
+        free(env[i]);
     }
-    return -1;
+    free(env);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&fa);
+    close(s);
+    return m;
 }
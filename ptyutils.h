@@ -1,7 +1,8 @@
 #include <sys/types.h>
 
-extern pid_t child_pid;
-
-void execsh(unsigned long windowid, char** cmd, char* shell, char* termname);
-void sigchld(int a);
-int ttynew(unsigned short row, unsigned short col, unsigned long windowid, char** cmd, char* shell, char* termname);
+int childfd(pid_t pid);
+int childkill(int fd, int sig);
+int childreap(pid_t pid);
+void ttyprefetchuser(void);
+int ttynew(unsigned short row, unsigned short col, unsigned long windowid, char** cmd, char* shell, char* termname,
+        pid_t* pid);
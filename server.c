@@ -0,0 +1,725 @@
+/* See LICENSE for licence details. */
+/*
+ * stserver - a headless multiplexing server.
+ *
+ * Owns any number of shells, each on a Term kept current by the emulator
+ * core, and sends screen updates to attached clients over a unix socket
+ * (see stserver.h for the protocol). Sessions are sharded by id over one
+ * worker thread per core. Each worker drives its share from a single
+ * epoll loop, so idle sessions cost nothing but their memory.
+ */
+#define _GNU_SOURCE /* accept4() */
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "arg.h"
+#include "helpers.h"
+#include "libsuckterm.h"
+#include "ptyutils.h"
+#include "stserver.h"
+
+#define CLIENT_HIGHWATER (256*1024) /* no screen updates while more is unsent */
+#define MAX_EVENTS       64
+#define MAX_SIZE         1024 /* client sizes are clamped to this many cells */
+
+enum endpoint_kind {
+    EP_PTY,
+    EP_CLIENT,
+    EP_WAKE,
+    EP_GREET,
+};
+
+typedef struct Session Session;
+typedef struct Worker Worker;
+
+typedef struct {
+    char* s;
+    size_t len, size;
+} Buf;
+
+/* An fd registered with a worker's epoll */
+typedef struct {
+    int kind;
+    int fd;
+    uint32_t events;
+    /* currently requested events */
+    Session* s;
+} Endpoint;
+
+struct Session {
+    uint32_t id;
+    Worker* w;
+    Term* term;
+    Endpoint pty, client;
+    int pidfd;
+    /* the shell, -1 if the kernel has no pidfds */
+    Buf in, out;
+    /* client connection buffers */
+    size_t outpos;
+    /* bytes of out already sent */
+    int cx, cy;
+    bool cursorvisible, cursordirty;
+    bool dead;
+    /* the shell has exited, freed when settled */
+    bool touched;
+    Session* nexttouched;
+};
+
+/* A new connection whose first message is still being read */
+typedef struct {
+    Endpoint ep;
+    /* first, see greetevent() */
+    size_t len;
+    char buf[sizeof(MsgHeader) + sizeof(uint32_t)];
+} Greeting;
+
+/* A connection passed to the worker of its session */
+typedef struct Handoff {
+    int fd;
+    uint32_t type, id;
+    MsgSize size;
+    struct Handoff* next;
+} Handoff;
+
+struct Worker {
+    pthread_t thread;
+    int epfd;
+    Endpoint wake;
+    pthread_mutex_t lock;
+    Handoff* queue;
+    /* protected by lock */
+    Session** sessions;
+    /* indexed by id / nworkers */
+    size_t nsessions;
+    Session* touched;
+    /* sessions to settle after this batch of events */
+};
+
+char* argv0;
+static char* opt_socket = NULL;
+static char* opt_term = "xterm";
+static char* opt_shell = "/bin/sh";
+static int nworkers;
+static Worker* workers;
+static uint32_t nextid; /* of the next new session */
+
+static void clientinput(Session* s);
+
+static void bufput(Buf* b, const void* s, size_t n) {
+    if (b->len + n > b->size) {
+        b->size = MAX(b->size * 2, b->len + n);
+        b->s = xrealloc(b->s, b->size);
+    }
+    memcpy(b->s + b->len, s, n);
+    b->len += n;
+}
+
+static void bufclear(Buf* b) {
+    free(b->s);
+    *b = (Buf){ 0 };
+}
+
+static void epset(Worker* w, Endpoint* ep, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = ep };
+
+    if (ep->events == events) {
+        return;
+    }
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0) {
+        die("epoll_ctl failed: %s\n", SERRNO);
+    }
+    ep->events = events;
+}
+
+static void epadd(Worker* w, Endpoint* ep, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = ep };
+
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        die("epoll_ctl failed: %s\n", SERRNO);
+    }
+    ep->events = events;
+}
+
+/* Queues the session to be settled at the end of the event batch */
+static void touch(Session* s) {
+    if (!s->touched) {
+        s->touched = true;
+        s->nexttouched = s->w->touched;
+        s->w->touched = s;
+    }
+}
+
+/* Queues a message to the attached client, if any */
+static void csend(Session* s, uint32_t type, const void* payload, uint32_t len) {
+    MsgHeader h = { type, len };
+
+    if (s->client.fd < 0) {
+        return;
+    }
+    bufput(&s->out, &h, sizeof(h));
+    bufput(&s->out, payload, len);
+    touch(s);
+}
+
+/* Queues the dirty rows and the cursor for the client */
+static void sendscreen(Session* s) {
+    Term* term = s->term;
+    MsgHeader h = { MSG_ROW, sizeof(MsgRow) + term->col * sizeof(MsgCell) };
+    MsgRow row = { 0, term->col };
+    MsgCursor cur;
+    MsgCell cell;
+    long u;
+    int x, y;
+
+    for (y = 0; y < term->row; y++) {
+        if (!term->dirty[y]) {
+            continue;
+        }
+        term->dirty[y] = 0;
+        row.y = y;
+        bufput(&s->out, &h, sizeof(h));
+        bufput(&s->out, &row, sizeof(row));
+        for (x = 0; x < term->col; x++) {
+            utf8decode(term->line[y][x].c, &u);
+            cell = (MsgCell){
+                    .rune = (term->line[y][x].mode & ATTR_WDUMMY) ? 0 : u,
+                    .mode = term->line[y][x].mode,
+                    .fg = term->line[y][x].fg,
+                    .bg = term->line[y][x].bg,
+            };
+            bufput(&s->out, &cell, sizeof(cell));
+        }
+    }
+
+    if (s->cursordirty || s->cx != term->c.x || s->cy != term->c.y) {
+        s->cx = term->c.x;
+        s->cy = term->c.y;
+        s->cursordirty = false;
+        cur = (MsgCursor){ s->cx, s->cy, s->cursorvisible };
+        csend(s, MSG_CURSOR, &cur, sizeof(cur));
+    }
+}
+
+static void detach(Session* s) {
+    if (s->client.fd < 0) {
+        return;
+    }
+    epoll_ctl(s->w->epfd, EPOLL_CTL_DEL, s->client.fd, NULL);
+    close(s->client.fd);
+    s->client.fd = -1;
+    s->client.events = 0;
+    bufclear(&s->in);
+    bufclear(&s->out);
+    s->outpos = 0;
+}
+
+/*
+ * Polls the client for input unless the shell's write queue is full, so
+ * a shell that does not read pushes back on the client, not on memory.
+ */
+static void clientpoll(Session* s) {
+    epset(s->w, &s->client, (ttyblocked(s->term) ? 0 : EPOLLIN) | (s->out.len ? EPOLLOUT : 0));
+}
+
+/* Sends what the client accepts without blocking */
+static void clientflush(Session* s) {
+    ssize_t r;
+
+    while (s->outpos < s->out.len) {
+        r = send(s->client.fd, s->out.s + s->outpos, s->out.len - s->outpos, MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            detach(s);
+            return;
+        }
+        s->outpos += r;
+    }
+    if (s->outpos == s->out.len) {
+        s->out.len = s->outpos = 0;
+    }
+    clientpoll(s);
+}
+
+/*
+ * Ends a session whose shell has gone. The Session itself stays around
+ * until settled, as later events of the same batch may still point to it.
+ */
+static void sessionend(Session* s) {
+    MsgHeader exit = { MSG_EXIT, 0 };
+
+    if (s->client.fd >= 0) {
+        bufput(&s->out, &exit, sizeof(exit));
+        clientflush(s);
+    }
+    detach(s);
+    epoll_ctl(s->w->epfd, EPOLL_CTL_DEL, s->pty.fd, NULL);
+    /* the kernel reaps shells, so by now the pid may be someone else's */
+    if (s->pidfd >= 0) {
+        childkill(s->pidfd, SIGHUP);
+        close(s->pidfd);
+    }
+    s->term->pid = 0;
+    libsuckterm_notify_exit(s->term);
+    s->dead = true;
+    touch(s);
+}
+
+/* Brings pty and client up to date after a batch of events */
+static void settle(Session* s) {
+    Term* term = s->term;
+    size_t pending;
+
+    if (s->dead) {
+        s->w->sessions[s->id / nworkers] = NULL;
+        tfree(term);
+        free(s);
+        return;
+    }
+
+    pending = ttyflush(term);
+    if (s->client.fd >= 0 && s->in.len > 0 && !ttyblocked(term)) {
+        /* the shell caught up: resume the input held back */
+        clientinput(s);
+        pending = ttyflush(term);
+    }
+
+    /* always parsed, or a shell that does not read would deadlock */
+    epset(s->w, &s->pty, EPOLLIN | (pending ? EPOLLOUT : 0));
+    if (s->client.fd < 0) {
+        return;
+    }
+    if (s->out.len - s->outpos < CLIENT_HIGHWATER) {
+        sendscreen(s);
+    }
+    clientflush(s);
+}
+
+static void attach(Session* s, int fd) {
+    detach(s);
+    s->client = (Endpoint){ .kind = EP_CLIENT, .fd = fd, .s = s };
+    epadd(s->w, &s->client, EPOLLIN);
+    csend(s, MSG_SESSION, &s->id, sizeof(s->id));
+    tfulldirt(s->term);
+    s->cursordirty = true;
+}
+
+/* Clamps a client's size, as a huge one would exhaust the memory of all */
+static MsgSize clampsize(MsgSize size) {
+    LIMIT(size.cols, 1, MAX_SIZE);
+    LIMIT(size.rows, 1, MAX_SIZE);
+    return size;
+}
+
+static void newsession(Worker* w, uint32_t id, MsgSize size, int fd) {
+    Session* s = xmalloc(sizeof(Session));
+    size_t i = id / nworkers;
+
+    size = clampsize(size);
+    *s = (Session){
+            .id = id,
+            .w = w,
+            .term = tnew(size.cols, size.rows, 7, 0, 8),
+            .client = { .fd = -1 },
+            .cursorvisible = true,
+    };
+    s->term->user = s;
+    s->pty = (Endpoint){
+            .kind = EP_PTY,
+            .fd = libsuckterm_init(s->term, 0, NULL, opt_shell, opt_term),
+            .s = s,
+    };
+    epadd(w, &s->pty, EPOLLIN);
+    s->pidfd = s->term->pid > 0 ? childfd(s->term->pid) : -1;
+
+    if (i >= w->nsessions) {
+        w->sessions = xrealloc(w->sessions, (i + 1) * 2 * sizeof(Session*));
+        memset(w->sessions + w->nsessions, 0, ((i + 1) * 2 - w->nsessions) * sizeof(Session*));
+        w->nsessions = (i + 1) * 2;
+    }
+    w->sessions[i] = s;
+    attach(s, fd);
+}
+
+/* Queues a connection for the worker of its session */
+static void handoff(Handoff* h) {
+    Worker* w = &workers[h->id % nworkers];
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&w->lock);
+    h->next = w->queue;
+    w->queue = h;
+    pthread_mutex_unlock(&w->lock);
+    if (write(w->wake.fd, &one, sizeof(one)) < 0) {
+        die("eventfd write failed: %s\n", SERRNO);
+    }
+}
+
+/*
+ * Reads the first message of a connection without blocking, so a client
+ * that sends nothing only costs its fd. Nothing past the message is read:
+ * input may follow it.
+ */
+static void greetevent(Worker* w, Greeting* g) {
+    MsgHeader hdr;
+    Handoff* h;
+    size_t want = sizeof(hdr);
+    ssize_t r;
+
+    if (g->len >= sizeof(hdr)) {
+        memcpy(&hdr, g->buf, sizeof(hdr));
+        want += hdr.len;
+    }
+    r = recv(g->ep.fd, g->buf + g->len, want - g->len, 0);
+    if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+        goto drop;
+    }
+    if (r < 0 || (g->len += r) < sizeof(hdr)) {
+        return;
+    }
+    memcpy(&hdr, g->buf, sizeof(hdr));
+    if (!(hdr.type == MSG_NEW && hdr.len == sizeof(MsgSize))
+            && !(hdr.type == MSG_ATTACH && hdr.len == sizeof(uint32_t))) {
+        goto drop;
+    }
+    if (g->len < sizeof(hdr) + hdr.len) {
+        return;
+    }
+
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, g->ep.fd, NULL);
+    h = xmalloc(sizeof(Handoff));
+    *h = (Handoff){ .fd = g->ep.fd, .type = hdr.type };
+    if (hdr.type == MSG_NEW) {
+        memcpy(&h->size, g->buf + sizeof(hdr), sizeof(MsgSize));
+        h->id = __atomic_fetch_add(&nextid, 1, __ATOMIC_RELAXED);
+    } else {
+        memcpy(&h->id, g->buf + sizeof(hdr), sizeof(uint32_t));
+    }
+    handoff(h);
+    free(g);
+    return;
+
+    drop:
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, g->ep.fd, NULL);
+    close(g->ep.fd);
+    free(g);
+}
+
+/* Takes over the connections queued for this worker */
+static void handoffs(Worker* w) {
+    Handoff* h, * next;
+    Session* s;
+    uint64_t n;
+    MsgHeader exit = { MSG_EXIT, 0 };
+
+    if (read(w->wake.fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        die("eventfd read failed: %s\n", SERRNO);
+    }
+    pthread_mutex_lock(&w->lock);
+    h = w->queue;
+    w->queue = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    for (; h; h = next) {
+        next = h->next;
+        if (h->type == MSG_NEW) {
+            newsession(w, h->id, h->size, h->fd);
+        } else if (h->id / nworkers < w->nsessions && (s = w->sessions[h->id / nworkers])
+                && !s->dead) {
+            attach(s, h->fd);
+        } else {
+            send(h->fd, &exit, sizeof(exit), MSG_NOSIGNAL);
+            close(h->fd);
+        }
+        free(h);
+    }
+}
+
+static void ptyevent(Session* s, uint32_t events) {
+    if (events & EPOLLOUT) {
+        touch(s);
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    if (ttyread(s->term) < 0) {
+        sessionend(s);
+        return;
+    }
+    while (ttyparse(s->term, TTY_BUF_SIZ)) {
+        ;
+    }
+    touch(s);
+}
+
+/*
+ * Handles the complete messages buffered from the client. Input stops
+ * while the shell is not reading its own, and is resumed by settle().
+ */
+static void clientinput(Session* s) {
+    MsgHeader h;
+    MsgSize size;
+    size_t off = 0;
+
+    while (s->in.len - off >= sizeof(h) && !ttyblocked(s->term)) {
+        memcpy(&h, s->in.s + off, sizeof(h));
+        if (h.len > MSG_MAX_LEN) {
+            detach(s);
+            return;
+        }
+        if (s->in.len - off < sizeof(h) + h.len) {
+            break;
+        }
+        off += sizeof(h);
+        switch (h.type) {
+            case MSG_INPUT:
+                ttysend(s->term, s->in.s + off, h.len);
+                break;
+            case MSG_RESIZE:
+                if (h.len != sizeof(size)) {
+                    detach(s);
+                    return;
+                }
+                memcpy(&size, s->in.s + off, sizeof(size));
+                size = clampsize(size);
+                libsuckterm_notify_set_size(s->term, size.cols, size.rows, 0, 0);
+                break;
+            default:
+                detach(s);
+                return;
+        }
+        off += h.len;
+    }
+    memmove(s->in.s, s->in.s + off, s->in.len - off);
+    s->in.len -= off;
+}
+
+static void clientevent(Session* s, uint32_t events) {
+    char tmp[BUFSIZ];
+    ssize_t r;
+
+    touch(s);
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        r = recv(s->client.fd, tmp, sizeof(tmp), 0);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            detach(s);
+            return;
+        }
+        if (r > 0) {
+            bufput(&s->in, tmp, r);
+        }
+    }
+
+    clientinput(s);
+    if (s->client.fd < 0) {
+        /* dropped for a malformed message */
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        clientflush(s);
+    }
+}
+
+static void* workerloop(void* arg) {
+    Worker* w = arg;
+    struct epoll_event ev[MAX_EVENTS];
+    Endpoint* ep;
+    Session* s;
+    int i, n;
+
+    for (;;) {
+        if ((n = epoll_wait(w->epfd, ev, LEN(ev), -1)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait failed: %s\n", SERRNO);
+        }
+        for (i = 0; i < n; i++) {
+            ep = ev[i].data.ptr;
+            switch (ep->kind) {
+                case EP_WAKE:
+                    handoffs(w);
+                    break;
+                case EP_GREET:
+                    greetevent(w, (Greeting*)ep);
+                    break;
+                case EP_PTY:
+                    if (!ep->s->dead) {
+                        ptyevent(ep->s, ev[i].events);
+                    }
+                    break;
+                case EP_CLIENT:
+                    /* may have been detached earlier in this batch */
+                    if (!ep->s->dead && ep->fd >= 0) {
+                        clientevent(ep->s, ev[i].events);
+                    }
+                    break;
+            }
+        }
+        while ((s = w->touched)) {
+            w->touched = s->nexttouched;
+            s->touched = false;
+            settle(s);
+        }
+    }
+    return NULL;
+}
+
+/* frontend callbacks: forwarded to the client */
+void libsuckterm_cb_bell(Term* t) {
+    csend(t->user, MSG_BELL, NULL, 0);
+}
+
+void libsuckterm_cb_set_title(Term* t, char* p) {
+    csend(t->user, MSG_TITLE, p, strlen(p));
+}
+
+void libsuckterm_cb_reset_title(Term* t) {
+    csend(t->user, MSG_TITLE, NULL, 0);
+}
+
+void libsuckterm_cb_set_cursor_visibility(Term* t, bool visible) {
+    Session* s = t->user;
+
+    s->cursorvisible = visible;
+    s->cursordirty = true;
+}
+
+/*
+ * The default socket: in $XDG_RUNTIME_DIR, or else in a directory under
+ * /tmp that only we may enter.
+ */
+static void socketpath(char* path, size_t size) {
+    char* dir = getenv("XDG_RUNTIME_DIR");
+    struct stat st;
+
+    if (dir && *dir) {
+        snprintf(path, size, "%s/stserver", dir);
+        return;
+    }
+    snprintf(path, size, "/tmp/stserver-%u", (unsigned)getuid());
+    if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+        die("cannot create %s: %s\n", path, SERRNO);
+    }
+    if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid()
+            || (st.st_mode & 077)) {
+        die("%s is not a private directory\n", path);
+    }
+    strncat(path, "/socket", size - strlen(path) - 1);
+}
+
+/* Only our own user may drive the shells */
+static bool peerallowed(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static void usage(void) {
+    die("usage: %s [-s socket] [-j threads] [-e shell] [-T termname]\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char path[sizeof(addr.sun_path)];
+    Greeting* g;
+    mode_t mask;
+    int i, lfd, fd, next = 0;
+
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ARGBEGIN {
+        case 's':
+            opt_socket = EARGF(usage());
+            break;
+        case 'j':
+            nworkers = atoi(EARGF(usage()));
+            break;
+        case 'e':
+            opt_shell = EARGF(usage());
+            break;
+        case 'T':
+            opt_term = EARGF(usage());
+            break;
+        default:
+            usage();
+    } ARGEND;
+
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    if (!opt_socket) {
+        socketpath(path, sizeof(path));
+        opt_socket = path;
+    }
+    if (strlen(opt_socket) >= sizeof(addr.sun_path)) {
+        die("socket path too long: %s\n", opt_socket);
+    }
+    strcpy(addr.sun_path, opt_socket);
+
+    /* exited shells are reaped by the kernel; lost clients are not fatal */
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        die("socket failed: %s\n", SERRNO);
+    }
+    unlink(opt_socket);
+    mask = umask(077);
+    if (bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0) {
+        die("cannot listen on %s: %s\n", opt_socket, SERRNO);
+    }
+    umask(mask);
+
+    workers = xmalloc(nworkers * sizeof(Worker));
+    for (i = 0; i < nworkers; i++) {
+        workers[i] = (Worker){ .wake = { .kind = EP_WAKE } };
+        pthread_mutex_init(&workers[i].lock, NULL);
+        if ((workers[i].epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            die("epoll_create1 failed: %s\n", SERRNO);
+        }
+        if ((workers[i].wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            die("eventfd failed: %s\n", SERRNO);
+        }
+        epadd(&workers[i], &workers[i].wake, EPOLLIN);
+        if (pthread_create(&workers[i].thread, NULL, workerloop, &workers[i]) != 0) {
+            die("pthread_create failed\n");
+        }
+    }
+
+    for (;;) {
+        /* shells forked meanwhile must not inherit client sockets */
+        if ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            die("accept failed: %s\n", SERRNO);
+        }
+        if (!peerallowed(fd)) {
+            close(fd);
+            continue;
+        }
+        /* epoll_ctl() is thread-safe: the worker reads the greeting */
+        g = xmalloc(sizeof(Greeting));
+        *g = (Greeting){ .ep = { .kind = EP_GREET, .fd = fd } };
+        epadd(&workers[next], &g->ep, EPOLLIN);
+        next = (next + 1) % nworkers;
+    }
+
+    return 0;
+}
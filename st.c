@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -25,8 +26,6 @@
 #include "helpers.h"
 #include "libsuckterm.h"
 
-char* argv0;
-
 #if defined(__linux)
 
 # include <pty.h>
@@ -39,10 +38,9 @@ char* argv0;
 
 
 /* Arbitrary sizes */
-#define ESC_BUF_SIZ   (128*UTF_SIZ)
-#define ESC_ARG_SIZ   16
-#define STR_BUF_SIZ   ESC_BUF_SIZ
-#define STR_ARG_SIZ   ESC_ARG_SIZ
+#define WQ_INIT_SIZ   4096
+#define WQ_HIGHWATER  (64*1024)
+#define WQ_MAX        (4*WQ_HIGHWATER) /* replies beyond are dropped */
 
 /* macros */
 #define VT102ID "\033[?6c"
@@ -77,80 +75,49 @@ enum escape_state {
             ESC_TEST = 32, /* Enter in test mode */
 };
 
-/* CSI Escape sequence structs */
-/* ESC '[' [[ [<priv>] <arg> [;]] <mode>] */
-typedef struct {
-    char buf[ESC_BUF_SIZ];
-    /* raw string */
-    int len;
-    /* raw string length */
-    char priv;
-    int arg[ESC_ARG_SIZ];
-    int narg;
-    /* nb of args */
-    char mode;
-} CSIEscape;
-
-/* STR Escape sequence structs */
-/* ESC type [[ [<priv>] <arg> [;]] <mode>] ESC '\' */
-typedef struct {
-    char type;
-    /* ESC type ... */
-    char buf[STR_BUF_SIZ];
-    /* raw string */
-    int len;
-    /* raw string length */
-    char* args[STR_ARG_SIZ];
-    int narg;              /* nb of args */
-} STREscape;
-
 // pty.c
 
-static void csihandle(void);
-static void csiparse(void);
-static void csireset(void);
-static void strhandle(void);
-static void strparse(void);
-
-static void move_row_contents(int y, int x_dst, int x_src, int count);
-static void tclearregion(int, int, int, int);
-static void tcursor(int);
-static void tdeletechar(int);
-static void tdeleteline(int);
-static void tinsertblank(int);
-static void tinsertblankline(int);
-static void tmoveto(int, int);
-static void tmoveato(int x, int y);
-static void tnewline(int);
-static void tputtab(bool);
-static void tputc(char*, int);
-static void treset();
-static int tresize(int, int);
-static void tscrollup(int, int);
-static void tscrolldown(int, int);
-static void tsetchar(char*, Cell*, int, int);
-static void tsetscroll(int, int);
-static void tswapscreen(void);
-static void tsetdirt(int, int);
-static void tsetmode(bool, bool, int*, int);
-static void techo(char*, int);
-static long tdefcolor(int*, int*, int);
-static void tselcs(void);
-static void tdeftran(char);
-
-/* Globals */
-Term term;
-static CSIEscape csiescseq;
-static STREscape strescseq;
-static int cmdfd;
-
-static void csidump(void) {
+static void csihandle(Term*);
+static void csiparse(Term*);
+static void csireset(Term*);
+static void strhandle(Term*);
+static void strparse(Term*);
+
+static void move_row_contents(Term* term, int y, int x_dst, int x_src, int count);
+static void tclearregion(Term*, int, int, int, int);
+static void tcursor(Term*, int);
+static void tdeletechar(Term*, int);
+static void tdeleteline(Term*, int);
+static int temit(Term*, int, int, char*);
+static void tfreesnap(Snapshot*);
+static void tinsertblank(Term*, int);
+static void tinsertblankline(Term*, int);
+static void tmoveto(Term*, int, int);
+static void tmoveato(Term* term, int x, int y);
+static void tnewline(Term*, int);
+static void tputtab(Term*, bool);
+static void tputc(Term*, char*, int);
+static void treset(Term*);
+static int tresize(Term*, int, int);
+static void tscrollup(Term*, int, int);
+static void tscrolldown(Term*, int, int);
+static void tsetchar(Term*, char*, Cell*, int, int);
+static void tsetscroll(Term*, int, int);
+static void tswapscreen(Term*);
+static void tsetdirt(Term*, int, int);
+static void tsetmode(Term*, bool, bool, int*, int);
+static void techo(Term*, char*, int);
+static long tdefcolor(Term*, int*, int*, int);
+static void tselcs(Term*);
+static void tdeftran(Term*, char);
+
+static void csidump(Term* term) {
     int i;
     uint c;
 
     fprintf(stderr, "ESC[");
-    for (i = 0; i < csiescseq.len; i++) {
-        c = csiescseq.buf[i] & 0xff;
+    for (i = 0; i < term->csiescseq.len; i++) {
+        c = term->csiescseq.buf[i] & 0xff;
         if (isprint(c)) {
             fputc(c, stderr);
         } else if (c == '\n') {
@@ -166,13 +133,13 @@ static void csidump(void) {
     fputc('\n', stderr);
 }
 
-static void strdump(void) {
+static void strdump(Term* term) {
     int i;
     uint c;
 
-    fprintf(stderr, "ESC%c", strescseq.type);
-    for (i = 0; i < strescseq.len; i++) {
-        c = strescseq.buf[i] & 0xff;
+    fprintf(stderr, "ESC%c", term->strescseq.type);
+    for (i = 0; i < term->strescseq.len; i++) {
+        c = term->strescseq.buf[i] & 0xff;
         if (c == '\0') {
             return;
         } else if (isprint(c)) {
@@ -192,195 +159,426 @@ static void strdump(void) {
 
 #include "ptyutils.h"
 
-void ttyread(void) {
-    static char buf[BUFSIZ];
-    static int buflen = 0;
-    char* ptr;
-    char s[UTF_SIZ];
-    int charsize; /* size of utf8 char in bytes */
-    long utf8c;
+/* Moves the unparsed input to the start of the buffer */
+static void ttycompact(Term* term) {
+    if (term->ttybufpos > 0) {
+        memmove(term->ttybuf, term->ttybuf + term->ttybufpos, term->ttybuflen);
+        term->ttybufpos = 0;
+    }
+}
+
+/*
+ * Appends whatever the shell has written to the unparsed input. Returns the
+ * number of bytes read, or -1 once the pty has failed or been hung up.
+ */
+int ttyread(Term* term) {
     int ret;
 
-    /* append read bytes to unprocessed bytes */
-    if ((ret = read(cmdfd, buf + buflen, LEN(buf) - buflen)) < 0) {
-        die("Couldn't read from shell: %s\n", SERRNO);
+    ttycompact(term);
+    if (term->ttybuflen == TTY_BUF_SIZ) {
+        return 0;
+    }
+    if ((ret = read(term->cmdfd, term->ttybuf + term->ttybuflen, TTY_BUF_SIZ - term->ttybuflen)) < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        return -1;
     }
+    if (ret == 0) {
+        errno = EIO;
+        return -1;
+    }
+    term->ttybuflen += ret;
+    return ret;
+}
 
-    /* process every complete utf8 char */
-    buflen += ret;
-    ptr = buf;
-    while (buflen >= UTF_SIZ || isfullutf8(ptr, buflen)) {
+/* Measures the run of jump-scrollable input at s, see Term.jumplen */
+static void tjumpscan(Term* term, const char* s, int n) {
+    int i = 0, j;
+
+    term->jumplines = 0;
+    while (i < n) {
+        if (s[i] == '\033') {
+            j = i + 1;
+            if (j + 1 < n && s[j] && strchr("()*+", s[j]) && BETWEEN(s[j + 1], 0x20, 0x7E)) {
+                i = j + 2;
+                continue;
+            }
+            if (j >= n || s[j] != '[') {
+                break;
+            }
+            for (j++; j < n && j - i < ESC_BUF_SIZ - 1
+                    && (isdigit((uchar)s[j]) || s[j] == ';' || s[j] == ':'); j++) {
+                ;
+            }
+            if (j >= n || s[j] != 'm') {
+                break;
+            }
+            i = j + 1;
+            continue;
+        }
+        if (s[i] == '\n' || s[i] == '\v' || s[i] == '\f') {
+            term->jumplines++;
+        }
+        i++;
+    }
+    term->jumplen = i;
+}
+
+/* Performs the scrolling deferred while jumping */
+static void tjumpflush(Term* term) {
+    term->jumping = false;
+    if (term->jumpscroll) {
+        tscrollup(term, term->top, term->jumpscroll);
+        term->jumpscroll = 0;
+    }
+}
+
+/*
+ * Parses roughly max bytes of the buffered input. Returns true while
+ * complete characters are still left for another call.
+ */
+bool ttyparse(Term* term, size_t max) {
+    char* ptr = term->ttybuf + term->ttybufpos;
+    char* end = ptr + max;
+    char s[UTF_SIZ];
+    int charsize; /* size of utf8 char in bytes */
+    long utf8c;
+
+    /* process complete utf8 chars */
+    while (ptr < end && (term->ttybuflen >= UTF_SIZ || isfullutf8(ptr, term->ttybuflen))) {
+        if (term->jumplen <= 0 && !term->esc && term->top == 0 && term->bot == term->row - 1) {
+            tjumpscan(term, ptr, term->ttybuflen);
+        }
         charsize = utf8decode(ptr, &utf8c);
         utf8encode(&utf8c, s);
-        tputc(s, charsize);
+        if (term->jumplen > 0) {
+            term->jumplen -= charsize;
+            if (*ptr == '\n' || *ptr == '\v' || *ptr == '\f') {
+                term->jumplines--;
+            }
+            term->jumping = term->jumplines >= term->row;
+        }
+        if (!term->jumping && term->jumpscroll) {
+            tjumpflush(term);
+        }
+        tputc(term, s, charsize);
         ptr += charsize;
-        buflen -= charsize;
+        term->ttybuflen -= charsize;
     }
+    tjumpflush(term);
 
-    /* keep any uncomplete utf8 char for the next call */
-    memmove(buf, ptr, buflen);
+    /* keep the rest, including any uncomplete utf8 char, for the next call */
+    term->ttybufpos = ptr - term->ttybuf;
+    return term->ttybuflen >= UTF_SIZ || isfullutf8(ptr, term->ttybuflen);
 }
 
-void ttywrite(const char* s, size_t n) {
-    if (xwrite(cmdfd, s, n) == -1) {
-        die("write error on tty: %s\n", SERRNO);
+/*
+ * Parses bytes from the caller instead of the pty. Without a pty the replies
+ * the input asks for are dropped, as nothing would ever flush them.
+ */
+void libsuckterm_feed(Term* term, const char* s, size_t n) {
+    size_t chunk;
+
+    while (n > 0) {
+        ttycompact(term);
+        chunk = MIN(n, TTY_BUF_SIZ - term->ttybuflen);
+        memcpy(term->ttybuf + term->ttybuflen, s, chunk);
+        term->ttybuflen += chunk;
+        s += chunk;
+        n -= chunk;
+        while (ttyparse(term, TTY_BUF_SIZ)) {
+            ;
+        }
+    }
+    if (term->cmdfd < 0) {
+        ttyflush(term);
     }
 }
 
-void ttysend(char* s, size_t n) {
-    ttywrite(s, n);
-    if (IS_SET(MODE_ECHO)) {
-        techo(s, n);
+/* Queues bytes for the pty, see ttyflush() */
+void ttywrite(Term* term, const char* s, size_t n) {
+    size_t tail, chunk;
+    char* grown;
+
+    if (term->wqlen + n > term->wqsize) {
+        /* grow and unwrap */
+        tail = term->wqsize;
+        term->wqsize = MAX(term->wqsize, WQ_INIT_SIZ);
+        while (term->wqsize < term->wqlen + n) {
+            term->wqsize *= 2;
+        }
+        grown = xmalloc(term->wqsize);
+        chunk = MIN(term->wqlen, tail - term->wqhead);
+        memcpy(grown, term->wq + term->wqhead, chunk);
+        memcpy(grown + chunk, term->wq, term->wqlen - chunk);
+        free(term->wq);
+        term->wq = grown;
+        term->wqhead = 0;
+    }
+
+    tail = (term->wqhead + term->wqlen) % term->wqsize;
+    chunk = MIN(n, term->wqsize - tail);
+    memcpy(term->wq + tail, s, chunk);
+    memcpy(term->wq, s + chunk, n - chunk);
+    term->wqlen += n;
+}
+
+/*
+ * Queues an answer to a request in the output. A child that sends requests
+ * but does not read would otherwise grow the queue without limit.
+ */
+static void ttyreply(Term* term, const char* s, size_t n) {
+    if (term->wqlen + n <= WQ_MAX) {
+        ttywrite(term, s, n);
+    }
+}
+
+/* Writes as much of the queue as the pty accepts; returns what is left */
+size_t ttyflush(Term* term) {
+    struct iovec iov[2];
+    ssize_t r;
+    int n;
+
+    if (term->cmdfd < 0) {
+        /* headless: replies have nowhere to go */
+        term->wqhead = term->wqlen = 0;
+    }
+    while (term->wqlen > 0) {
+        iov[0].iov_base = term->wq + term->wqhead;
+        iov[0].iov_len = MIN(term->wqlen, term->wqsize - term->wqhead);
+        iov[1].iov_base = term->wq;
+        iov[1].iov_len = term->wqlen - iov[0].iov_len;
+        n = iov[1].iov_len ? 2 : 1;
+
+        if ((r = writev(term->cmdfd, iov, n)) < 0) {
+            if (errno == EAGAIN || errno == EINTR) {
+                break;
+            }
+            /* the pty is gone; ttyread() reports it */
+            term->wqhead = term->wqlen = 0;
+            break;
+        }
+        term->wqhead = (term->wqhead + r) % term->wqsize;
+        term->wqlen -= r;
+    }
+    if (term->wqlen == 0) {
+        term->wqhead = 0;
+    }
+    return term->wqlen;
+}
+
+/* True when so much is queued that the frontend should stop sending input */
+bool ttyblocked(Term* term) {
+    return term->wqlen >= WQ_HIGHWATER;
+}
+
+void ttysend(Term* term, char* s, size_t n) {
+    ttywrite(term, s, n);
+    if (IS_SET(term, MODE_ECHO)) {
+        techo(term, s, n);
     }
 }
 
-void ttyresize(void) {
+void ttyresize(Term* term) {
     struct winsize w;
 
-    w.ws_row = term.row;
-    w.ws_col = term.col;
-    w.ws_xpixel = term.tw;
-    w.ws_ypixel = term.th;
-    if (ioctl(cmdfd, TIOCSWINSZ, &w) < 0) {
+    if (term->cmdfd < 0) {
+        return;
+    }
+    w.ws_row = term->row;
+    w.ws_col = term->col;
+    w.ws_xpixel = term->tw;
+    w.ws_ypixel = term->th;
+    if (ioctl(term->cmdfd, TIOCSWINSZ, &w) < 0) {
         fprintf(stderr, "Couldn't set window size: %s\n", SERRNO);
     }
 }
 
+/* Marks row @y as changed, for the frontend and the next snapshot */
+static inline void tdirty(Term* term, int y) {
+    term->dirty[y] = 1;
+    term->changed[y] = 1;
+}
+
 /* Marks lines [top..bot] as dirty */
-void tsetdirt(int top, int bot) {
+void tsetdirt(Term* term, int top, int bot) {
     int i;
 
-    LIMIT(top, 0, term.row - 1);
-    LIMIT(bot, 0, term.row - 1);
+    LIMIT(top, 0, term->row - 1);
+    LIMIT(bot, 0, term->row - 1);
 
     for (i = top; i <= bot; i++) {
-        term.dirty[i] = 1;
+        tdirty(term, i);
     }
 }
 
 /* Marks all lines as dirty */
-void tfulldirt(void) {
-    tsetdirt(0, term.row - 1);
+void tfulldirt(Term* term) {
+    tsetdirt(term, 0, term->row - 1);
 }
 
 /* Loads or saves the VT100 saved cursor */
-void tcursor(int mode) {
-    static TCursor c[2];
-    bool alt = IS_SET(MODE_ALTSCREEN);
+void tcursor(Term* term, int mode) {
+    bool alt = IS_SET(term, MODE_ALTSCREEN);
 
     if (mode == CURSOR_SAVE) {
-        c[alt] = term.c;
+        term->saved[alt] = term->c;
     } else if (mode == CURSOR_LOAD) {
-        term.c = c[alt];
-        tmoveto(c[alt].x, c[alt].y);
+        term->c = term->saved[alt];
+        tmoveto(term, term->saved[alt].x, term->saved[alt].y);
     }
 }
 
-void treset() {
+void treset(Term* term) {
     uint i;
 
-    term.c = (TCursor){ {
+    term->c = (TCursor){ {
             .mode = ATTR_NULL,
-            .fg = term.defaultfg,
-            .bg = term.defaultbg,
+            .fg = term->defaultfg,
+            .bg = term->defaultbg,
     }, .x = 0, .y = 0, .state = CURSOR_DEFAULT };
 
-    memset(term.tabs, 0, term.col * sizeof(*term.tabs));
-    for (i = term.tabspaces; i < term.col; i += term.tabspaces) {
-        term.tabs[i] = 1;
+    memset(term->tabs, 0, term->col * sizeof(*term->tabs));
+    for (i = term->tabspaces; i < term->col; i += term->tabspaces) {
+        term->tabs[i] = 1;
     }
-    term.top = 0;
-    term.bot = term.row - 1;
-    term.mode = MODE_WRAP;
-    memset(term.trantbl, sizeof(term.trantbl), CS_USA);
-    term.charset = 0;
-
-    tclearregion(0, 0, term.col - 1, term.row - 1);
-    tmoveto(0, 0);
-    tcursor(CURSOR_SAVE);
+    term->top = 0;
+    term->bot = term->row - 1;
+    term->mode = MODE_WRAP;
+    memset(term->trantbl, sizeof(term->trantbl), CS_USA);
+    term->charset = 0;
+
+    tclearregion(term, 0, 0, term->col - 1, term->row - 1);
+    tmoveto(term, 0, 0);
+    tcursor(term, CURSOR_SAVE);
 }
 
-void tnew(int col, int row, unsigned int defaultfg, unsigned int defaultbg, unsigned int tabspaces) {
-    term = (Term){
+/* Creates a terminal; it has no pty until libsuckterm_init() */
+Term* tnew(int col, int row, unsigned int defaultfg, unsigned int defaultbg, unsigned int tabspaces) {
+    Term* term = xmalloc(sizeof(Term));
+
+    *term = (Term){
             .defaultfg = defaultfg,
             .defaultbg = defaultbg,
             .tabspaces = tabspaces,
             .c = { .attr = { .fg = defaultfg, .bg = defaultbg, }, },
+            .cmdfd = -1,
+            .ttybuf = xmalloc(TTY_BUF_SIZ),
+            .oldbutton = 3, /* button event on startup: 3 = release */
     };
-    tresize(col, row);
-    treset();
+    tresize(term, col, row);
+    treset(term);
+    return term;
+}
+
+/* Frees a terminal created by tnew(), closing its pty */
+void tfree(Term* term) {
+    Snapshot* s;
+    int i;
+
+    for (i = 0; i < term->row; i++) {
+        free(term->line[i]);
+        free(term->alt[i]);
+    }
+    free(term->line);
+    free(term->alt);
+    free(term->dirty);
+    free(term->changed);
+    free(term->tabs);
+    free(term->ttybuf);
+    free(term->wq);
+    if (term->ev) {
+        for (; term->evhead != term->evtail; term->evhead++) {
+            free(term->ev[term->evhead & (term->evsize - 1)].str);
+        }
+        free(term->ev);
+    }
+    if (term->snap) {
+        tfreesnap(term->snap);
+    }
+    while ((s = term->retired)) {
+        term->retired = s->next;
+        tfreesnap(s);
+    }
+    if (term->cmdfd >= 0) {
+        close(term->cmdfd);
+    }
+    free(term);
 }
 
-void tswapscreen(void) {
-    Line* tmp = term.line;
+void tswapscreen(Term* term) {
+    Line* tmp = term->line;
 
-    term.line = term.alt;
-    term.alt = tmp;
-    term.mode ^= MODE_ALTSCREEN;
-    tfulldirt();
+    term->line = term->alt;
+    term->alt = tmp;
+    term->mode ^= MODE_ALTSCREEN;
+    tfulldirt(term);
 }
 
 /* Scrolls screen lines below @orig down @n lines, creating empty lines near @orig. */
-void tscrolldown(int orig, int n) {
+void tscrolldown(Term* term, int orig, int n) {
     int i;
     Line temp;
 
-    LIMIT(n, 0, term.bot - orig + 1);
+    LIMIT(n, 0, term->bot - orig + 1);
 
-    tclearregion(0, term.bot - n + 1, term.col - 1, term.bot);
+    tclearregion(term, 0, term->bot - n + 1, term->col - 1, term->bot);
 
-    for (i = term.bot; i >= orig + n; i--) {
-        temp = term.line[i];
-        term.line[i] = term.line[i - n];
-        term.line[i - n] = temp;
+    for (i = term->bot; i >= orig + n; i--) {
+        temp = term->line[i];
+        term->line[i] = term->line[i - n];
+        term->line[i - n] = temp;
 
-        term.dirty[i] = 1;
-        term.dirty[i - n] = 1;
+        tdirty(term, i);
+        tdirty(term, i - n);
     }
 }
 
 /* Scrolls screen lines below @orig up @n lines, creating empty lines at the bottom. */
-void tscrollup(int orig, int n) {
+void tscrollup(Term* term, int orig, int n) {
     int i;
     Line temp;
-    LIMIT(n, 0, term.bot - orig + 1);
+    LIMIT(n, 0, term->bot - orig + 1);
 
-    tclearregion(0, orig, term.col - 1, orig + n - 1);
+    tclearregion(term, 0, orig, term->col - 1, orig + n - 1);
 
-    for (i = orig; i <= term.bot - n; i++) {
-        temp = term.line[i];
-        term.line[i] = term.line[i + n];
-        term.line[i + n] = temp;
+    for (i = orig; i <= term->bot - n; i++) {
+        temp = term->line[i];
+        term->line[i] = term->line[i + n];
+        term->line[i + n] = temp;
 
-        term.dirty[i] = 1;
-        term.dirty[i + n] = 1;
+        tdirty(term, i);
+        tdirty(term, i + n);
     }
 }
 
 /* Moves cursor to the next line, creating a new blank line at the bottom if necessary */
-void tnewline(int first_col) {
-    int y = term.c.y;
+void tnewline(Term* term, int first_col) {
+    int y = term->c.y;
 
-    if (y == term.bot) {
-        tscrollup(term.top, 1);
+    if (y == term->bot && term->jumping) {
+        term->jumpscroll++;
+    } else if (y == term->bot) {
+        tscrollup(term, term->top, 1);
     } else {
         y++;
     }
-    tmoveto(first_col ? 0 : term.c.x, y);
+    tmoveto(term, first_col ? 0 : term->c.x, y);
 }
 
-void csiparse(void) {
-    char* p = csiescseq.buf, * np;
+void csiparse(Term* term) {
+    char* p = term->csiescseq.buf, * np;
     long int v;
 
-    csiescseq.narg = 0;
+    term->csiescseq.narg = 0;
     if (*p == '?') {
-        csiescseq.priv = 1;
+        term->csiescseq.priv = 1;
         p++;
     }
 
-    csiescseq.buf[csiescseq.len] = '\0';
-    while (p < csiescseq.buf + csiescseq.len) {
+    term->csiescseq.buf[term->csiescseq.len] = '\0';
+    while (p < term->csiescseq.buf + term->csiescseq.len) {
         np = NULL;
         v = strtol(p, &np, 10);
         if (np == p) {
@@ -389,41 +587,41 @@ void csiparse(void) {
         if (v == LONG_MAX || v == LONG_MIN) {
             v = -1;
         }
-        csiescseq.arg[csiescseq.narg++] = v;
+        term->csiescseq.arg[term->csiescseq.narg++] = v;
         p = np;
-        if (*p != ';' || csiescseq.narg == ESC_ARG_SIZ) {
+        if (*p != ';' || term->csiescseq.narg == ESC_ARG_SIZ) {
             break;
         }
         p++;
     }
-    csiescseq.mode = *p;
+    term->csiescseq.mode = *p;
 }
 
 /* Moves the cursor to a position relative to the scroll region */
-void tmoveato(int x, int y) {
-    tmoveto(x, y + ((term.c.state & CURSOR_ORIGIN) ? term.top : 0));
+void tmoveato(Term* term, int x, int y) {
+    tmoveto(term, x, y + ((term->c.state & CURSOR_ORIGIN) ? term->top : 0));
 }
 
 /* Moves the cursor to an absolute screen position */
-void tmoveto(int x, int y) {
+void tmoveto(Term* term, int x, int y) {
     int miny, maxy;
 
-    if (term.c.state & CURSOR_ORIGIN) {
-        miny = term.top;
-        maxy = term.bot;
+    if (term->c.state & CURSOR_ORIGIN) {
+        miny = term->top;
+        maxy = term->bot;
     } else {
         miny = 0;
-        maxy = term.row - 1;
+        maxy = term->row - 1;
     }
-    LIMIT(x, 0, term.col - 1);
+    LIMIT(x, 0, term->col - 1);
     LIMIT(y, miny, maxy);
-    term.c.state &= ~CURSOR_WRAPNEXT;
-    term.c.x = x;
-    term.c.y = y;
+    term->c.state &= ~CURSOR_WRAPNEXT;
+    term->c.x = x;
+    term->c.y = y;
 }
 
 /* Puts an UTF8-encoded character @c with attributes @attr to position @x, @y */
-void tsetchar(char* c, Cell* attr, int x, int y) {
+void tsetchar(Term* term, char* c, Cell* attr, int x, int y) {
     static char* vt100_0[62] = { /* 0x41 - 0x7e */
             "↑", "↓", "→", "←", "█", "▚", "☃", /* A - G */
             0, 0, 0, 0, 0, 0, 0, 0, /* H - O */
@@ -444,22 +642,22 @@ void tsetchar(char* c, Cell* attr, int x, int y) {
         }
     }
 
-    if (term.line[y][x].mode & ATTR_WIDE) {
-        if (x + 1 < term.col) {
-            term.line[y][x + 1].c[0] = ' ';
-            term.line[y][x + 1].mode &= ~ATTR_WDUMMY;
+    if (term->line[y][x].mode & ATTR_WIDE) {
+        if (x + 1 < term->col) {
+            term->line[y][x + 1].c[0] = ' ';
+            term->line[y][x + 1].mode &= ~ATTR_WDUMMY;
         }
-    } else if (term.line[y][x].mode & ATTR_WDUMMY) {
-        term.line[y][x - 1].c[0] = ' ';
-        term.line[y][x - 1].mode &= ~ATTR_WIDE;
+    } else if (term->line[y][x].mode & ATTR_WDUMMY) {
+        term->line[y][x - 1].c[0] = ' ';
+        term->line[y][x - 1].mode &= ~ATTR_WIDE;
     }
 
-    term.dirty[y] = 1;
-    term.line[y][x] = *attr;
-    memcpy(term.line[y][x].c, c, UTF_SIZ);
+    tdirty(term, y);
+    term->line[y][x] = *attr;
+    memcpy(term->line[y][x].c, c, UTF_SIZ);
 }
 
-void tclearregion(int x1, int y1, int x2, int y2) {
+void tclearregion(Term* term, int x1, int y1, int x2, int y2) {
     int x, y, temp;
 
     if (x1 > x2) {
@@ -469,16 +667,16 @@ void tclearregion(int x1, int y1, int x2, int y2) {
         temp = y1, y1 = y2, y2 = temp;
     }
 
-    LIMIT(x1, 0, term.col - 1);
-    LIMIT(x2, 0, term.col - 1);
-    LIMIT(y1, 0, term.row - 1);
-    LIMIT(y2, 0, term.row - 1);
+    LIMIT(x1, 0, term->col - 1);
+    LIMIT(x2, 0, term->col - 1);
+    LIMIT(y1, 0, term->row - 1);
+    LIMIT(y2, 0, term->row - 1);
 
     for (y = y1; y <= y2; y++) {
-        term.dirty[y] = 1;
+        tdirty(term, y);
         for (x = x1; x <= x2; x++) {
-            term.line[y][x] = term.c.attr;
-            memcpy(term.line[y][x].c, " ", 2);
+            term->line[y][x] = term->c.attr;
+            memcpy(term->line[y][x].c, " ", 2);
         }
     }
 }
@@ -487,55 +685,55 @@ void tclearregion(int x1, int y1, int x2, int y2) {
    Deletes @n characters at the current cursor position,
    moving rest of the characters on that line to the left.
  */
-void tdeletechar(int n) {
-    int src = term.c.x + n;
-    int dst = term.c.x;
-    int size = term.col - src;
+void tdeletechar(Term* term, int n) {
+    int src = term->c.x + n;
+    int dst = term->c.x;
+    int size = term->col - src;
 
-    term.dirty[term.c.y] = 1;
+    tdirty(term, term->c.y);
 
-    if (src >= term.col) {
-        tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
+    if (src >= term->col) {
+        tclearregion(term, term->c.x, term->c.y, term->col - 1, term->c.y);
         return;
     }
 
-    move_row_contents(term.c.y, dst, src, size);
-    tclearregion(term.col - n, term.c.y, term.col - 1, term.c.y);
+    move_row_contents(term, term->c.y, dst, src, size);
+    tclearregion(term, term->col - n, term->c.y, term->col - 1, term->c.y);
 }
 
-void tinsertblank(int n) {
-    int src = term.c.x;
+void tinsertblank(Term* term, int n) {
+    int src = term->c.x;
     int dst = src + n;
-    int size = term.col - dst;
+    int size = term->col - dst;
 
-    term.dirty[term.c.y] = 1;
+    tdirty(term, term->c.y);
 
-    if (dst >= term.col) {
-        tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
+    if (dst >= term->col) {
+        tclearregion(term, term->c.x, term->c.y, term->col - 1, term->c.y);
         return;
     }
 
-    move_row_contents(term.c.y, dst, src, size);
-    tclearregion(src, term.c.y, dst - 1, term.c.y);
+    move_row_contents(term, term->c.y, dst, src, size);
+    tclearregion(term, src, term->c.y, dst - 1, term->c.y);
 }
 
-void tinsertblankline(int n) {
-    if (term.c.y < term.top || term.c.y > term.bot) {
+void tinsertblankline(Term* term, int n) {
+    if (term->c.y < term->top || term->c.y > term->bot) {
         return;
     }
 
-    tscrolldown(term.c.y, n);
+    tscrolldown(term, term->c.y, n);
 }
 
-void tdeleteline(int n) {
-    if (term.c.y < term.top || term.c.y > term.bot) {
+void tdeleteline(Term* term, int n) {
+    if (term->c.y < term->top || term->c.y > term->bot) {
         return;
     }
 
-    tscrollup(term.c.y, n);
+    tscrollup(term, term->c.y, n);
 }
 
-long tdefcolor(int* attr, int* npar, int l) {
+long tdefcolor(Term* term, int* attr, int* npar, int l) {
     long idx = -1;
     uint r, g, b;
 
@@ -584,79 +782,79 @@ long tdefcolor(int* attr, int* npar, int l) {
     return idx;
 }
 
-void tsetattr(int* attr, int l) {
+void tsetattr(Term* term, int* attr, int l) {
     int i;
     long idx;
 
     for (i = 0; i < l; i++) {
         switch (attr[i]) {
             case 0:
-                term.c.attr.mode &= ~(ATTR_REVERSE | ATTR_UNDERLINE | ATTR_BOLD | ATTR_ITALIC | ATTR_BLINK);
-                term.c.attr.fg = term.defaultfg;
-                term.c.attr.bg = term.defaultbg;
+                term->c.attr.mode &= ~(ATTR_REVERSE | ATTR_UNDERLINE | ATTR_BOLD | ATTR_ITALIC | ATTR_BLINK);
+                term->c.attr.fg = term->defaultfg;
+                term->c.attr.bg = term->defaultbg;
                 break;
             case 1:
-                term.c.attr.mode |= ATTR_BOLD;
+                term->c.attr.mode |= ATTR_BOLD;
                 break;
             case 3:
-                term.c.attr.mode |= ATTR_ITALIC;
+                term->c.attr.mode |= ATTR_ITALIC;
                 break;
             case 4:
-                term.c.attr.mode |= ATTR_UNDERLINE;
+                term->c.attr.mode |= ATTR_UNDERLINE;
                 break;
             case 5: /* slow blink */
             case 6: /* rapid blink */
-                term.c.attr.mode |= ATTR_BLINK;
+                term->c.attr.mode |= ATTR_BLINK;
                 break;
             case 7:
-                term.c.attr.mode |= ATTR_REVERSE;
+                term->c.attr.mode |= ATTR_REVERSE;
                 break;
             case 21:
             case 22:
-                term.c.attr.mode &= ~ATTR_BOLD;
+                term->c.attr.mode &= ~ATTR_BOLD;
                 break;
             case 23:
-                term.c.attr.mode &= ~ATTR_ITALIC;
+                term->c.attr.mode &= ~ATTR_ITALIC;
                 break;
             case 24:
-                term.c.attr.mode &= ~ATTR_UNDERLINE;
+                term->c.attr.mode &= ~ATTR_UNDERLINE;
                 break;
             case 25:
             case 26:
-                term.c.attr.mode &= ~ATTR_BLINK;
+                term->c.attr.mode &= ~ATTR_BLINK;
                 break;
             case 27:
-                term.c.attr.mode &= ~ATTR_REVERSE;
+                term->c.attr.mode &= ~ATTR_REVERSE;
                 break;
             case 38:
-                if ((idx = tdefcolor(attr, &i, l)) >= 0) {
-                    term.c.attr.fg = idx;
+                if ((idx = tdefcolor(term, attr, &i, l)) >= 0) {
+                    term->c.attr.fg = idx;
                 }
                 break;
             case 39:
-                term.c.attr.fg = term.defaultfg;
+                term->c.attr.fg = term->defaultfg;
                 break;
             case 48:
-                if ((idx = tdefcolor(attr, &i, l)) >= 0) {
-                    term.c.attr.bg = idx;
+                if ((idx = tdefcolor(term, attr, &i, l)) >= 0) {
+                    term->c.attr.bg = idx;
                 }
                 break;
             case 49:
-                term.c.attr.bg = term.defaultbg;
+                term->c.attr.bg = term->defaultbg;
                 break;
             default:
                 if (BETWEEN(attr[i], 30, 37)) {
-                    term.c.attr.fg = attr[i] - 30;
+                    term->c.attr.fg = attr[i] - 30;
                 } else if (BETWEEN(attr[i], 40, 47)) {
-                    term.c.attr.bg = attr[i] - 40;
+                    term->c.attr.bg = attr[i] - 40;
                 } else if (BETWEEN(attr[i], 90, 97)) {
-                    term.c.attr.fg = attr[i] - 90 + 8;
+                    term->c.attr.fg = attr[i] - 90 + 8;
                 } else if (BETWEEN(attr[i], 100, 107)) {
-                    term.c.attr.bg = attr[i] - 100 + 8;
+                    term->c.attr.bg = attr[i] - 100 + 8;
                 } else {
                     fprintf(stderr,
                             "erresc(default): gfx attr %d unknown\n",
-                            attr[i]), csidump();
+                            attr[i]), csidump(term);
                 }
                 break;
         }
@@ -667,21 +865,21 @@ void tsetattr(int* attr, int l) {
  Sets scroll region. Only lines inside the scroll region will scroll.
  Also, if DECOM is set, cursor can't go outside scroll region.
  */
-void tsetscroll(int t, int b) {
+void tsetscroll(Term* term, int t, int b) {
     int temp;
 
-    LIMIT(t, 0, term.row - 1);
-    LIMIT(b, 0, term.row - 1);
+    LIMIT(t, 0, term->row - 1);
+    LIMIT(b, 0, term->row - 1);
     if (t > b) {
         temp = t;
         t = b;
         b = temp;
     }
-    term.top = t;
-    term.bot = b;
+    term->top = t;
+    term->bot = b;
 }
 
-void tsetmode(bool priv, bool set, int* args, int narg) {
+void tsetmode(Term* term, bool priv, bool set, int* args, int narg) {
     int* lim;
     bool alt;
 
@@ -690,17 +888,17 @@ void tsetmode(bool priv, bool set, int* args, int narg) {
             switch (*args) {
                 break;
                 case 1: /* DECCKM -- Cursor key */
-                    MODBIT(term.mode, set, MODE_APPCURSOR);
+                    MODBIT(term->mode, set, MODE_APPCURSOR);
                     break;
                 case 5: /* DECSCNM -- Reverse video */
-                    libsuckterm_cb_set_reverse_video(set);
+                    temit(term, LIBSUCKTERM_EVENT_REVERSE_VIDEO, set, NULL);
                     break;
                 case 6: /* DECOM -- Origin */
-                    MODBIT(term.c.state, set, CURSOR_ORIGIN);
-                    tmoveato(0, 0);
+                    MODBIT(term->c.state, set, CURSOR_ORIGIN);
+                    tmoveato(term, 0, 0);
                     break;
                 case 7: /* DECAWM -- Auto wrap */
-                    MODBIT(term.mode, set, MODE_WRAP);
+                    MODBIT(term->mode, set, MODE_WRAP);
                     break;
                 case 0:  /* Error (IGNORED) */
                 case 2:  /* DECANM -- ANSI/VT52 (IGNORED) */
@@ -710,61 +908,66 @@ void tsetmode(bool priv, bool set, int* args, int narg) {
                 case 18: /* DECPFF -- Printer feed (IGNORED) */
                 case 19: /* DECPEX -- Printer extent (IGNORED) */
                 case 42: /* DECNRCM -- National characters (IGNORED) */
-                case 12: /* att610 -- Start blinking cursor (IGNORED) */
+                    break;
+                case 12: /* att610 -- Start blinking cursor */
+                    temit(term, LIBSUCKTERM_EVENT_CURSOR_BLINK, set, NULL);
                     break;
                 case 25: /* DECTCEM -- Text Cursor Enable Mode */
-                    libsuckterm_cb_set_cursor_visibility(set);
+                    temit(term, LIBSUCKTERM_EVENT_CURSOR_VISIBILITY, set, NULL);
                     break;
                 case 9:    /* X10 mouse compatibility mode */
-                    libsuckterm_cb_set_pointer_motion(0);
-                    MODBIT(term.mode, 0, MODE_MOUSE);
-                    MODBIT(term.mode, set, MODE_MOUSEX10);
+                    temit(term, LIBSUCKTERM_EVENT_POINTER_MOTION, 0, NULL);
+                    MODBIT(term->mode, 0, MODE_MOUSE);
+                    MODBIT(term->mode, set, MODE_MOUSEX10);
                     break;
                 case 1000: /* 1000: report button press */
-                    libsuckterm_cb_set_pointer_motion(0);
-                    MODBIT(term.mode, 0, MODE_MOUSE);
-                    MODBIT(term.mode, set, MODE_MOUSEBTN);
+                    temit(term, LIBSUCKTERM_EVENT_POINTER_MOTION, 0, NULL);
+                    MODBIT(term->mode, 0, MODE_MOUSE);
+                    MODBIT(term->mode, set, MODE_MOUSEBTN);
                     break;
                 case 1002: /* 1002: report motion on button press */
-                    libsuckterm_cb_set_pointer_motion(0);
-                    MODBIT(term.mode, 0, MODE_MOUSE);
-                    MODBIT(term.mode, set, MODE_MOUSEMOTION);
+                    temit(term, LIBSUCKTERM_EVENT_POINTER_MOTION, 0, NULL);
+                    MODBIT(term->mode, 0, MODE_MOUSE);
+                    MODBIT(term->mode, set, MODE_MOUSEMOTION);
                     break;
                 case 1003: /* 1003: enable all mouse motions */
-                    libsuckterm_cb_set_pointer_motion(set);
-                    MODBIT(term.mode, 0, MODE_MOUSE);
-                    MODBIT(term.mode, set, MODE_MOUSEMANY);
+                    temit(term, LIBSUCKTERM_EVENT_POINTER_MOTION, set, NULL);
+                    MODBIT(term->mode, 0, MODE_MOUSE);
+                    MODBIT(term->mode, set, MODE_MOUSEMANY);
                     break;
                 case 1004: /* 1004: send focus events to tty */
-                    MODBIT(term.mode, set, MODE_FOCUS);
+                    MODBIT(term->mode, set, MODE_FOCUS);
                     break;
                 case 1006: /* 1006: extended reporting mode */
-                    MODBIT(term.mode, set, MODE_MOUSESGR);
+                    MODBIT(term->mode, set, MODE_MOUSESGR);
                     break;
                 case 1034:
-                    MODBIT(term.mode, set, MODE_8BIT);
+                    MODBIT(term->mode, set, MODE_8BIT);
                     break;
                 case 1049: /* swap screen & set/restore cursor as xterm */
-                    tcursor((set) ? CURSOR_SAVE : CURSOR_LOAD);
+                    tcursor(term, (set) ? CURSOR_SAVE : CURSOR_LOAD);
                 case 47: /* swap screen */
                 case 1047:
-                    alt = IS_SET(MODE_ALTSCREEN);
+                    alt = IS_SET(term, MODE_ALTSCREEN);
                     if (alt) {
-                        tclearregion(0, 0, term.col - 1,
-                                term.row - 1);
+                        tclearregion(term, 0, 0, term->col - 1,
+                                term->row - 1);
                     }
                     if (set ^ alt) { /* set is always 1 or 0 */
-                        tswapscreen();
+                        tswapscreen(term);
                     }
                     if (*args != 1049) {
                         break;
                     }
                     /* FALLTRU */
                 case 1048:
-                    tcursor((set) ? CURSOR_SAVE : CURSOR_LOAD);
+                    tcursor(term, (set) ? CURSOR_SAVE : CURSOR_LOAD);
                     break;
                 case 2004: /* 2004: bracketed paste mode */
-                    MODBIT(term.mode, set, MODE_BRCKTPASTE);
+                    MODBIT(term->mode, set, MODE_BRCKTPASTE);
+                    break;
+                case 2026: /* 2026: synchronized output, see the frontend */
+                    MODBIT(term->mode, set, MODE_SYNC);
                     break;
 
                     /* Not implemented mouse modes. See comments there. */
@@ -783,16 +986,16 @@ void tsetmode(bool priv, bool set, int* args, int narg) {
                 case 0:  /* Error (IGNORED) */
                     break;
                 case 2:  /* KAM -- keyboard action */
-                    MODBIT(term.mode, set, MODE_KBDLOCK);
+                    MODBIT(term->mode, set, MODE_KBDLOCK);
                     break;
                 case 4:  /* IRM -- Insertion-replacement */
-                    MODBIT(term.mode, set, MODE_INSERT);
+                    MODBIT(term->mode, set, MODE_INSERT);
                     break;
                 case 12: /* SRM -- Send/Receive */
-                    MODBIT(term.mode, !set, MODE_ECHO);
+                    MODBIT(term->mode, !set, MODE_ECHO);
                     break;
                 case 20: /* LNM -- Linefeed/new line */
-                    MODBIT(term.mode, set, MODE_CRLF);
+                    MODBIT(term->mode, set, MODE_CRLF);
                     break;
                 default:
                     fprintf(stderr,
@@ -804,59 +1007,59 @@ void tsetmode(bool priv, bool set, int* args, int narg) {
     }
 }
 
-void csihandle(void) {
+void csihandle(Term* term) {
     char buf[40];
     int len;
 
-    switch (csiescseq.mode) {
+    switch (term->csiescseq.mode) {
         default:
         unknown:
             fprintf(stderr, "erresc: unknown csi ");
-            csidump();
+            csidump(term);
             /* die(""); */
             break;
         case '@': /* ICH -- Insert <n> blank char */
-            DEFAULT(csiescseq.arg[0], 1);
-            tinsertblank(csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tinsertblank(term, term->csiescseq.arg[0]);
             break;
         case 'A': /* CUU -- Cursor <n> Up */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(term.c.x, term.c.y - csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, term->c.x, term->c.y - term->csiescseq.arg[0]);
             break;
         case 'B': /* CUD -- Cursor <n> Down */
         case 'e': /* VPR --Cursor <n> Down */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(term.c.x, term.c.y + csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, term->c.x, term->c.y + term->csiescseq.arg[0]);
             break;
         case 'c': /* DA -- Device Attributes */
-            if (csiescseq.arg[0] == 0) {
-                ttywrite(VT102ID, sizeof(VT102ID) - 1);
+            if (term->csiescseq.arg[0] == 0) {
+                ttyreply(term, VT102ID, sizeof(VT102ID) - 1);
             }
             break;
         case 'C': /* CUF -- Cursor <n> Forward */
         case 'a': /* HPR -- Cursor <n> Forward */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(term.c.x + csiescseq.arg[0], term.c.y);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, term->c.x + term->csiescseq.arg[0], term->c.y);
             break;
         case 'D': /* CUB -- Cursor <n> Backward */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(term.c.x - csiescseq.arg[0], term.c.y);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, term->c.x - term->csiescseq.arg[0], term->c.y);
             break;
         case 'E': /* CNL -- Cursor <n> Down and first col */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(0, term.c.y + csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, 0, term->c.y + term->csiescseq.arg[0]);
             break;
         case 'F': /* CPL -- Cursor <n> Up and first col */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(0, term.c.y - csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, 0, term->c.y - term->csiescseq.arg[0]);
             break;
         case 'g': /* TBC -- Tabulation clear */
-            switch (csiescseq.arg[0]) {
+            switch (term->csiescseq.arg[0]) {
                 case 0: /* clear current tab stop */
-                    term.tabs[term.c.x] = 0;
+                    term->tabs[term->c.x] = 0;
                     break;
                 case 3: /* clear all the tabs */
-                    memset(term.tabs, 0, term.col * sizeof(*term.tabs));
+                    memset(term->tabs, 0, term->col * sizeof(*term->tabs));
                     break;
                 default:
                     goto unknown;
@@ -864,232 +1067,241 @@ void csihandle(void) {
             break;
         case 'G': /* CHA -- Move to <col> */
         case '`': /* HPA */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveto(csiescseq.arg[0] - 1, term.c.y);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveto(term, term->csiescseq.arg[0] - 1, term->c.y);
             break;
         case 'H': /* CUP -- Move to <row> <col> */
         case 'f': /* HVP */
-            DEFAULT(csiescseq.arg[0], 1);
-            DEFAULT(csiescseq.arg[1], 1);
-            tmoveato(csiescseq.arg[1] - 1, csiescseq.arg[0] - 1);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            DEFAULT(term->csiescseq.arg[1], 1);
+            tmoveato(term, term->csiescseq.arg[1] - 1, term->csiescseq.arg[0] - 1);
             break;
         case 'I': /* CHT -- Cursor Forward Tabulation <n> tab stops */
-            DEFAULT(csiescseq.arg[0], 1);
-            while (csiescseq.arg[0]--) {
-                tputtab(1);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            while (term->csiescseq.arg[0]--) {
+                tputtab(term, 1);
             }
             break;
         case 'J': /* ED -- Clear screen */
-            switch (csiescseq.arg[0]) {
+            switch (term->csiescseq.arg[0]) {
                 case 0: /* below */
-                    tclearregion(term.c.x, term.c.y, term.col - 1, term.c.y);
-                    if (term.c.y < term.row - 1) {
-                        tclearregion(0, term.c.y + 1, term.col - 1,
-                                term.row - 1);
+                    tclearregion(term, term->c.x, term->c.y, term->col - 1, term->c.y);
+                    if (term->c.y < term->row - 1) {
+                        tclearregion(term, 0, term->c.y + 1, term->col - 1,
+                                term->row - 1);
                     }
                     break;
                 case 1: /* above */
-                    if (term.c.y > 1) {
-                        tclearregion(0, 0, term.col - 1, term.c.y - 1);
+                    if (term->c.y > 1) {
+                        tclearregion(term, 0, 0, term->col - 1, term->c.y - 1);
                     }
-                    tclearregion(0, term.c.y, term.c.x, term.c.y);
+                    tclearregion(term, 0, term->c.y, term->c.x, term->c.y);
                     break;
                 case 2: /* all */
-                    tclearregion(0, 0, term.col - 1, term.row - 1);
+                    tclearregion(term, 0, 0, term->col - 1, term->row - 1);
                     break;
                 default:
                     goto unknown;
             }
             break;
         case 'K': /* EL -- Clear line */
-            switch (csiescseq.arg[0]) {
+            switch (term->csiescseq.arg[0]) {
                 case 0: /* right */
-                    tclearregion(term.c.x, term.c.y, term.col - 1,
-                            term.c.y);
+                    tclearregion(term, term->c.x, term->c.y, term->col - 1,
+                            term->c.y);
                     break;
                 case 1: /* left */
-                    tclearregion(0, term.c.y, term.c.x, term.c.y);
+                    tclearregion(term, 0, term->c.y, term->c.x, term->c.y);
                     break;
                 case 2: /* all */
-                    tclearregion(0, term.c.y, term.col - 1, term.c.y);
+                    tclearregion(term, 0, term->c.y, term->col - 1, term->c.y);
                     break;
             }
             break;
         case 'S': /* SU -- Scroll <n> line up */
-            DEFAULT(csiescseq.arg[0], 1);
-            tscrollup(term.top, csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tscrollup(term, term->top, term->csiescseq.arg[0]);
             break;
         case 'T': /* SD -- Scroll <n> line down */
-            DEFAULT(csiescseq.arg[0], 1);
-            tscrolldown(term.top, csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tscrolldown(term, term->top, term->csiescseq.arg[0]);
             break;
         case 'L': /* IL -- Insert <n> blank lines */
-            DEFAULT(csiescseq.arg[0], 1);
-            tinsertblankline(csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tinsertblankline(term, term->csiescseq.arg[0]);
             break;
         case 'l': /* RM -- Reset Mode */
-            tsetmode(csiescseq.priv, 0, csiescseq.arg, csiescseq.narg);
+            tsetmode(term, term->csiescseq.priv, 0, term->csiescseq.arg, term->csiescseq.narg);
             break;
         case 'M': /* DL -- Delete <n> lines */
-            DEFAULT(csiescseq.arg[0], 1);
-            tdeleteline(csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tdeleteline(term, term->csiescseq.arg[0]);
             break;
         case 'X': /* ECH -- Erase <n> char */
-            DEFAULT(csiescseq.arg[0], 1);
-            tclearregion(term.c.x, term.c.y,
-                    term.c.x + csiescseq.arg[0] - 1, term.c.y);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tclearregion(term, term->c.x, term->c.y,
+                    term->c.x + term->csiescseq.arg[0] - 1, term->c.y);
             break;
         case 'P': /* DCH -- Delete <n> char */
-            DEFAULT(csiescseq.arg[0], 1);
-            tdeletechar(csiescseq.arg[0]);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tdeletechar(term, term->csiescseq.arg[0]);
             break;
         case 'Z': /* CBT -- Cursor Backward Tabulation <n> tab stops */
-            DEFAULT(csiescseq.arg[0], 1);
-            while (csiescseq.arg[0]--) {
-                tputtab(0);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            while (term->csiescseq.arg[0]--) {
+                tputtab(term, 0);
             }
             break;
         case 'd': /* VPA -- Move to <row> */
-            DEFAULT(csiescseq.arg[0], 1);
-            tmoveato(term.c.x, csiescseq.arg[0] - 1);
+            DEFAULT(term->csiescseq.arg[0], 1);
+            tmoveato(term, term->c.x, term->csiescseq.arg[0] - 1);
             break;
         case 'h': /* SM -- Set terminal mode */
-            tsetmode(csiescseq.priv, 1, csiescseq.arg, csiescseq.narg);
+            tsetmode(term, term->csiescseq.priv, 1, term->csiescseq.arg, term->csiescseq.narg);
             break;
         case 'm': /* SGR -- Terminal attribute (color) */
-            tsetattr(csiescseq.arg, csiescseq.narg);
+            tsetattr(term, term->csiescseq.arg, term->csiescseq.narg);
             break;
         case 'n': /* DSR – Device Status Report (cursor position) */
-            if (csiescseq.arg[0] == 6) {
+            if (term->csiescseq.arg[0] == 6) {
                 len = snprintf(buf, sizeof(buf), "\033[%i;%iR",
-                        term.c.y + 1, term.c.x + 1);
-                ttywrite(buf, len);
+                        term->c.y + 1, term->c.x + 1);
+                ttyreply(term, buf, len);
                 break;
             }
         case 'r': /* DECSTBM -- Set Scrolling Region */
-            if (csiescseq.priv) {
+            if (term->csiescseq.priv) {
                 goto unknown;
             } else {
-                DEFAULT(csiescseq.arg[0], 1);
-                DEFAULT(csiescseq.arg[1], term.row);
-                tsetscroll(csiescseq.arg[0] - 1, csiescseq.arg[1] - 1);
-                tmoveato(0, 0);
+                DEFAULT(term->csiescseq.arg[0], 1);
+                DEFAULT(term->csiescseq.arg[1], term->row);
+                tsetscroll(term, term->csiescseq.arg[0] - 1, term->csiescseq.arg[1] - 1);
+                tmoveato(term, 0, 0);
             }
             break;
+        case '$': /* DECRQM -- Request mode, only for synchronized output */
+            if (!term->csiescseq.priv || term->csiescseq.buf[term->csiescseq.len - 1] != 'p'
+                    || term->csiescseq.arg[0] != 2026) {
+                goto unknown;
+            }
+            len = snprintf(buf, sizeof(buf), "\033[?2026;%dy",
+                    IS_SET(term, MODE_SYNC) ? 1 : 2);
+            ttyreply(term, buf, len);
+            break;
         case 's': /* DECSC -- Save cursor position (ANSI.SYS) */
-            tcursor(CURSOR_SAVE);
+            tcursor(term, CURSOR_SAVE);
             break;
         case 'u': /* DECRC -- Restore cursor position (ANSI.SYS) */
-            tcursor(CURSOR_LOAD);
+            tcursor(term, CURSOR_LOAD);
             break;
     }
 }
 
-void csireset(void) {
-    memset(&csiescseq, 0, sizeof(csiescseq));
+void csireset(Term* term) {
+    memset(&term->csiescseq, 0, sizeof(term->csiescseq));
 }
 
-void strhandle(void) {
+void strhandle(Term* term) {
     char* p = NULL;
     int i, j, narg;
 
-    strparse();
-    narg = strescseq.narg;
+    strparse(term);
+    narg = term->strescseq.narg;
 
-    switch (strescseq.type) {
+    switch (term->strescseq.type) {
         case ']': /* OSC -- Operating System Command */
-            switch (i = atoi(strescseq.args[0])) {
+            switch (i = atoi(term->strescseq.args[0])) {
                 case 0:
                 case 1:
                 case 2:
                     if (narg > 1) {
-                        libsuckterm_cb_set_title(strescseq.args[1]);
+                        temit(term, LIBSUCKTERM_EVENT_TITLE, 0, term->strescseq.args[1]);
                     }
                     break;
                 case 4: /* color set */
                     if (narg < 3) {
                         break;
                     }
-                    p = strescseq.args[2];
+                    p = term->strescseq.args[2];
                     /* fall through */
                 case 104: /* color reset, here p = NULL */
-                    j = (narg > 1) ? atoi(strescseq.args[1]) : -1;
-                    if (!libsuckterm_cb_set_color(j, p)) {
+                    j = (narg > 1) ? atoi(term->strescseq.args[1]) : -1;
+                    if (!temit(term, LIBSUCKTERM_EVENT_COLOR, j, p)) {
                         fprintf(stderr, "erresc: invalid color %s\n", p);
                     }
                     break;
                 default:
                     fprintf(stderr, "erresc: unknown str ");
-                    strdump();
+                    strdump(term);
                     break;
             }
             break;
         case 'k': /* old title set compatibility */
-            libsuckterm_cb_set_title(strescseq.args[0]);
+            temit(term, LIBSUCKTERM_EVENT_TITLE, 0, term->strescseq.args[0]);
             break;
         case 'P': /* DSC -- Device Control String */
         case '_': /* APC -- Application Program Command */
         case '^': /* PM -- Privacy Message */
         default:
             fprintf(stderr, "erresc: unknown str ");
-            strdump();
+            strdump(term);
             /* die(""); */
             break;
     }
 }
 
-void strparse(void) {
-    char* p = strescseq.buf;
+void strparse(Term* term) {
+    char* p = term->strescseq.buf;
 
-    strescseq.narg = 0;
-    strescseq.buf[strescseq.len] = '\0';
-    while (p && strescseq.narg < STR_ARG_SIZ) {
-        strescseq.args[strescseq.narg++] = strsep(&p, ";");
+    term->strescseq.narg = 0;
+    term->strescseq.buf[term->strescseq.len] = '\0';
+    while (p && term->strescseq.narg < STR_ARG_SIZ) {
+        term->strescseq.args[term->strescseq.narg++] = strsep(&p, ";");
     }
 }
 
-void tputtab(bool forward) {
-    uint x = term.c.x;
+void tputtab(Term* term, bool forward) {
+    uint x = term->c.x;
 
     if (forward) {
-        if (x == term.col) {
+        if (x == term->col) {
             return;
         }
-        for (++x; x < term.col && !term.tabs[x]; ++x) {
+        for (++x; x < term->col && !term->tabs[x]; ++x) {
             /* nothing */ }
     } else {
         if (x == 0) {
             return;
         }
-        for (--x; x > 0 && !term.tabs[x]; --x) {
+        for (--x; x > 0 && !term->tabs[x]; --x) {
             /* nothing */ }
     }
-    tmoveto(x, term.c.y);
+    tmoveto(term, x, term->c.y);
 }
 
-void techo(char* buf, int len) {
+void techo(Term* term, char* buf, int len) {
     for (; len > 0; buf++, len--) {
         char c = *buf;
 
         if (c == '\033') { /* escape */
-            tputc("^", 1);
-            tputc("[", 1);
+            tputc(term, "^", 1);
+            tputc(term, "[", 1);
         } else if (c < '\x20') { /* control code */
             if (c != '\n' && c != '\r' && c != '\t') {
                 c |= '\x40';
-                tputc("^", 1);
+                tputc(term, "^", 1);
             }
-            tputc(&c, 1);
+            tputc(term, &c, 1);
         } else {
             break;
         }
     }
     if (len) {
-        tputc(buf, len);
+        tputc(term, buf, len);
     }
 }
 
-void tdeftran(char ascii) {
+void tdeftran(Term* term, char ascii) {
     char c, (* bp)[2];
     static char tbl[][2] = {
             { '0', CS_GRAPHIC0 }, { '1', CS_GRAPHIC1 }, { 'A', CS_UK },
@@ -1104,23 +1316,23 @@ void tdeftran(char ascii) {
     if (c == 0) {
         fprintf(stderr, "esc unhandled charset: ESC ( %c\n", ascii);
     } else {
-        term.trantbl[term.icharset] = (*bp)[1];
+        term->trantbl[term->icharset] = (*bp)[1];
     }
 }
 
-void tselcs(void) {
-    if (term.trantbl[term.charset] == CS_GRAPHIC0) {
-        term.c.attr.mode |= ATTR_GFX;
+void tselcs(Term* term) {
+    if (term->trantbl[term->charset] == CS_GRAPHIC0) {
+        term->c.attr.mode |= ATTR_GFX;
     } else {
-        term.c.attr.mode &= ~ATTR_GFX;
+        term->c.attr.mode &= ~ATTR_GFX;
     }
 }
 
-void move_row_contents(int y, int x_dst, int x_src, int count) {
-    memmove(&term.line[y][x_dst], &term.line[y][x_src], count * sizeof(Cell));
+void move_row_contents(Term* term, int y, int x_dst, int x_src, int count) {
+    memmove(&term->line[y][x_dst], &term->line[y][x_src], count * sizeof(Cell));
 }
 
-void tputc(char* c, int len) {
+void tputc(Term* term, char* c, int len) {
     uchar ascii = *c;
     bool control = ascii < '\x20' || ascii == 0177;
     long u8char;
@@ -1137,19 +1349,19 @@ void tputc(char* c, int len) {
      * STR sequences must be checked before anything else
      * because it can use some control codes as part of the sequence.
      */
-    if (term.esc & ESC_STR) {
+    if (term->esc & ESC_STR) {
         switch (ascii) {
             case '\033':
-                term.esc = ESC_START | ESC_STR_END;
+                term->esc = ESC_START | ESC_STR_END;
                 break;
             case '\a': /* backwards compatibility to xterm */
-                term.esc = 0;
-                strhandle();
+                term->esc = 0;
+                strhandle(term);
                 break;
             default:
-                if (strescseq.len + len < sizeof(strescseq.buf) - 1) {
-                    memmove(&strescseq.buf[strescseq.len], c, len);
-                    strescseq.len += len;
+                if (term->strescseq.len + len < sizeof(term->strescseq.buf) - 1) {
+                    memmove(&term->strescseq.buf[term->strescseq.len], c, len);
+                    term->strescseq.len += len;
                 } else {
                     /*
                      * Here is a bug in terminals. If the user never sends
@@ -1161,8 +1373,8 @@ void tputc(char* c, int len) {
                      * In the case users ever get fixed, here is the code:
                      */
                     /*
-                     * term.esc = 0;
-                     * strhandle();
+                     * term->esc = 0;
+                     * strhandle(term);
                      */
                 }
         }
@@ -1177,38 +1389,38 @@ void tputc(char* c, int len) {
     if (control) {
         switch (ascii) {
             case '\t':   /* HT */
-                tputtab(1);
+                tputtab(term, 1);
                 return;
             case '\b':   /* BS */
-                tmoveto(term.c.x - 1, term.c.y);
+                tmoveto(term, term->c.x - 1, term->c.y);
                 return;
             case '\r':   /* CR */
-                tmoveto(0, term.c.y);
+                tmoveto(term, 0, term->c.y);
                 return;
             case '\f':   /* LF */
             case '\v':   /* VT */
             case '\n':   /* LF */
                 /* go to first col if the mode is set */
-                tnewline(IS_SET(MODE_CRLF));
+                tnewline(term, IS_SET(term, MODE_CRLF));
                 return;
             case '\a':   /* BEL */
-                libsuckterm_cb_bell();
+                temit(term, LIBSUCKTERM_EVENT_BELL, 0, NULL);
                 return;
             case '\033': /* ESC */
-                csireset();
-                term.esc = ESC_START;
+                csireset(term);
+                term->esc = ESC_START;
                 return;
             case '\016': /* SO */
-                term.charset = 0;
-                tselcs();
+                term->charset = 0;
+                tselcs(term);
                 return;
             case '\017': /* SI */
-                term.charset = 1;
-                tselcs();
+                term->charset = 1;
+                tselcs(term);
                 return;
             case '\032': /* SUB */
             case '\030': /* CAN */
-                csireset();
+                csireset(term);
                 return;
             case '\005': /* ENQ (IGNORED) */
             case '\000': /* NUL (IGNORED) */
@@ -1217,116 +1429,116 @@ void tputc(char* c, int len) {
             case 0177:   /* DEL (IGNORED) */
                 return;
         }
-    } else if (term.esc & ESC_START) {
-        if (term.esc & ESC_CSI) {
-            csiescseq.buf[csiescseq.len++] = ascii;
-            if (BETWEEN(ascii, 0x40, 0x7E) || csiescseq.len >= sizeof(csiescseq.buf) - 1) {
-                term.esc = 0;
-                csiparse();
-                csihandle();
+    } else if (term->esc & ESC_START) {
+        if (term->esc & ESC_CSI) {
+            term->csiescseq.buf[term->csiescseq.len++] = ascii;
+            if (BETWEEN(ascii, 0x40, 0x7E) || term->csiescseq.len >= sizeof(term->csiescseq.buf) - 1) {
+                term->esc = 0;
+                csiparse(term);
+                csihandle(term);
             }
-        } else if (term.esc & ESC_STR_END) {
-            term.esc = 0;
+        } else if (term->esc & ESC_STR_END) {
+            term->esc = 0;
             if (ascii == '\\') {
-                strhandle();
+                strhandle(term);
             }
-        } else if (term.esc & ESC_ALTCHARSET) {
-            tdeftran(ascii);
-            tselcs();
-            term.esc = 0;
-        } else if (term.esc & ESC_TEST) {
+        } else if (term->esc & ESC_ALTCHARSET) {
+            tdeftran(term, ascii);
+            tselcs(term);
+            term->esc = 0;
+        } else if (term->esc & ESC_TEST) {
             if (ascii == '8') { /* DEC screen alignment test. */
                 char E[UTF_SIZ] = "E";
                 int x, y;
 
-                for (x = 0; x < term.col; ++x) {
-                    for (y = 0; y < term.row; ++y) {
-                        tsetchar(E, &term.c.attr, x, y);
+                for (x = 0; x < term->col; ++x) {
+                    for (y = 0; y < term->row; ++y) {
+                        tsetchar(term, E, &term->c.attr, x, y);
                     }
                 }
             }
-            term.esc = 0;
+            term->esc = 0;
         } else {
             switch (ascii) {
                 case '[':
-                    term.esc |= ESC_CSI;
+                    term->esc |= ESC_CSI;
                     break;
                 case '#':
-                    term.esc |= ESC_TEST;
+                    term->esc |= ESC_TEST;
                     break;
                 case 'P': /* DCS -- Device Control String */
                 case '_': /* APC -- Application Program Command */
                 case '^': /* PM -- Privacy Message */
                 case ']': /* OSC -- Operating System Command */
                 case 'k': /* old title set compatibility */
-                    memset(&strescseq, 0, sizeof(strescseq));
-                    strescseq.type = ascii;
-                    term.esc |= ESC_STR;
+                    memset(&term->strescseq, 0, sizeof(term->strescseq));
+                    term->strescseq.type = ascii;
+                    term->esc |= ESC_STR;
                     break;
                 case '(': /* set primary charset G0 */
                 case ')': /* set secondary charset G1 */
                 case '*': /* set tertiary charset G2 */
                 case '+': /* set quaternary charset G3 */
-                    term.icharset = ascii - '(';
-                    term.esc |= ESC_ALTCHARSET;
+                    term->icharset = ascii - '(';
+                    term->esc |= ESC_ALTCHARSET;
                     break;
                 case 'D': /* IND -- Linefeed */
-                    if (term.c.y == term.bot) {
-                        tscrollup(term.top, 1);
+                    if (term->c.y == term->bot) {
+                        tscrollup(term, term->top, 1);
                     } else {
-                        tmoveto(term.c.x, term.c.y + 1);
+                        tmoveto(term, term->c.x, term->c.y + 1);
                     }
-                    term.esc = 0;
+                    term->esc = 0;
                     break;
                 case 'E': /* NEL -- Next line */
-                    tnewline(1); /* always go to first col */
-                    term.esc = 0;
+                    tnewline(term, 1); /* always go to first col */
+                    term->esc = 0;
                     break;
                 case 'H': /* HTS -- Horizontal tab stop */
-                    term.tabs[term.c.x] = 1;
-                    term.esc = 0;
+                    term->tabs[term->c.x] = 1;
+                    term->esc = 0;
                     break;
                 case 'M': /* RI -- Reverse index */
-                    if (term.c.y == term.top) {
-                        tscrolldown(term.top, 1);
+                    if (term->c.y == term->top) {
+                        tscrolldown(term, term->top, 1);
                     } else {
-                        tmoveto(term.c.x, term.c.y - 1);
+                        tmoveto(term, term->c.x, term->c.y - 1);
                     }
-                    term.esc = 0;
+                    term->esc = 0;
                     break;
                 case 'Z': /* DECID -- Identify Terminal */
-                    ttywrite(VT102ID, sizeof(VT102ID) - 1);
-                    term.esc = 0;
+                    ttyreply(term, VT102ID, sizeof(VT102ID) - 1);
+                    term->esc = 0;
                     break;
                 case 'c': /* RIS -- Reset to inital state */
-                    treset();
-                    term.esc = 0;
-                    libsuckterm_cb_reset_title();
-                    libsuckterm_cb_reset_colors();
+                    treset(term);
+                    term->esc = 0;
+                    temit(term, LIBSUCKTERM_EVENT_TITLE, 0, NULL);
+                    temit(term, LIBSUCKTERM_EVENT_RESET_COLORS, 0, NULL);
                     break;
                 case '=': /* DECPAM -- Application keypad */
-                    term.mode |= MODE_APPKEYPAD;
-                    term.esc = 0;
+                    term->mode |= MODE_APPKEYPAD;
+                    term->esc = 0;
                     break;
                 case '>': /* DECPNM -- Normal keypad */
-                    term.mode &= ~MODE_APPKEYPAD;
-                    term.esc = 0;
+                    term->mode &= ~MODE_APPKEYPAD;
+                    term->esc = 0;
                     break;
                 case '7': /* DECSC -- Save Cursor */
-                    tcursor(CURSOR_SAVE);
-                    term.esc = 0;
+                    tcursor(term, CURSOR_SAVE);
+                    term->esc = 0;
                     break;
                 case '8': /* DECRC -- Restore Cursor */
-                    tcursor(CURSOR_LOAD);
-                    term.esc = 0;
+                    tcursor(term, CURSOR_LOAD);
+                    term->esc = 0;
                     break;
                 case '\\': /* ST -- Stop */
-                    term.esc = 0;
+                    term->esc = 0;
                     break;
                 default:
                     fprintf(stderr, "erresc: unknown sequence ESC 0x%02X '%c'\n",
                             (uchar)ascii, isprint(ascii) ? ascii : '.');
-                    term.esc = 0;
+                    term->esc = 0;
             }
         }
         /*
@@ -1338,43 +1550,46 @@ void tputc(char* c, int len) {
     /*
      * Display control codes only if we are in graphic mode
      */
-    if (control && !(term.c.attr.mode & ATTR_GFX)) {
+    if (control && !(term->c.attr.mode & ATTR_GFX)) {
         return;
     }
-    if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
-        term.line[term.c.y][term.c.x].mode |= ATTR_WRAP;
-        tnewline(1);
+    if (IS_SET(term, MODE_WRAP) && (term->c.state & CURSOR_WRAPNEXT)) {
+        term->line[term->c.y][term->c.x].mode |= ATTR_WRAP;
+        tdirty(term, term->c.y);
+        tnewline(term, 1);
     }
 
-    if (IS_SET(MODE_INSERT) && term.c.x + 1 < term.col) {
-        move_row_contents(term.c.y, term.c.x + 1, term.c.x, term.col - term.c.x - 1);
+    if (IS_SET(term, MODE_INSERT) && term->c.x + 1 < term->col && !term->jumping) {
+        move_row_contents(term, term->c.y, term->c.x + 1, term->c.x, term->col - term->c.x - 1);
     }
 
-    if (term.c.x + width > term.col) {
-        tnewline(1);
+    if (term->c.x + width > term->col) {
+        tnewline(term, 1);
     }
 
-    tsetchar(c, &term.c.attr, term.c.x, term.c.y);
-
-    if (width == 2) {
-        term.line[term.c.y][term.c.x].mode |= ATTR_WIDE;
-        if (term.c.x + 1 < term.col) {
-            term.line[term.c.y][term.c.x + 1].c[0] = '\0';
-            term.line[term.c.y][term.c.x + 1].mode = ATTR_WDUMMY;
+    /* while jumping the line scrolls off before it could be seen */
+    if (!term->jumping) {
+        tsetchar(term, c, &term->c.attr, term->c.x, term->c.y);
+        if (width == 2) {
+            term->line[term->c.y][term->c.x].mode |= ATTR_WIDE;
+            if (term->c.x + 1 < term->col) {
+                term->line[term->c.y][term->c.x + 1].c[0] = '\0';
+                term->line[term->c.y][term->c.x + 1].mode = ATTR_WDUMMY;
+            }
         }
     }
-    if (term.c.x + width < term.col) {
-        tmoveto(term.c.x + width, term.c.y);
+    if (term->c.x + width < term->col) {
+        tmoveto(term, term->c.x + width, term->c.y);
     } else {
-        term.c.state |= CURSOR_WRAPNEXT;
+        term->c.state |= CURSOR_WRAPNEXT;
     }
 }
 
-int tresize(int col, int row) {
+int tresize(Term* term, int col, int row) {
     int i;
-    int minrow = MIN(row, term.row);
-    int mincol = MIN(col, term.col);
-    int slide = term.c.y - row + 1;
+    int minrow = MIN(row, term->row);
+    int mincol = MIN(col, term->col);
+    int slide = term->c.y - row + 1;
     bool* bp;
     Line* orig;
 
@@ -1391,126 +1606,129 @@ int tresize(int col, int row) {
          * memmove because we're freeing the earlier lines
          */
         for (/* i = 0 */; i < slide; i++) {
-            free(term.line[i]);
-            free(term.alt[i]);
+            free(term->line[i]);
+            free(term->alt[i]);
         }
-        memmove(term.line, term.line + slide, row * sizeof(Line));
-        memmove(term.alt, term.alt + slide, row * sizeof(Line));
+        memmove(term->line, term->line + slide, row * sizeof(Line));
+        memmove(term->alt, term->alt + slide, row * sizeof(Line));
     }
-    for (i += row; i < term.row; i++) {
-        free(term.line[i]);
-        free(term.alt[i]);
+    for (i += row; i < term->row; i++) {
+        free(term->line[i]);
+        free(term->alt[i]);
     }
 
     /* resize to new height */
-    term.line = xrealloc(term.line, row * sizeof(Line));
-    term.alt = xrealloc(term.alt, row * sizeof(Line));
-    term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
-    term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
+    term->line = xrealloc(term->line, row * sizeof(Line));
+    term->alt = xrealloc(term->alt, row * sizeof(Line));
+    term->dirty = xrealloc(term->dirty, row * sizeof(*term->dirty));
+    term->changed = xrealloc(term->changed, row * sizeof(*term->changed));
+    term->tabs = xrealloc(term->tabs, col * sizeof(*term->tabs));
 
     /* resize each row to new width, zero-pad if needed */
     for (i = 0; i < minrow; i++) {
-        term.dirty[i] = 1;
-        term.line[i] = xrealloc(term.line[i], col * sizeof(Cell));
-        term.alt[i] = xrealloc(term.alt[i], col * sizeof(Cell));
+        tdirty(term, i);
+        term->line[i] = xrealloc(term->line[i], col * sizeof(Cell));
+        term->alt[i] = xrealloc(term->alt[i], col * sizeof(Cell));
     }
 
     /* allocate any new rows */
     for (/* i == minrow */; i < row; i++) {
-        term.dirty[i] = 1;
-        term.line[i] = xmalloc(col * sizeof(Cell));
-        term.alt[i] = xmalloc(col * sizeof(Cell));
+        tdirty(term, i);
+        term->line[i] = xmalloc(col * sizeof(Cell));
+        term->alt[i] = xmalloc(col * sizeof(Cell));
     }
-    if (col > term.col) {
-        bp = term.tabs + term.col;
+    if (col > term->col) {
+        bp = term->tabs + term->col;
 
-        memset(bp, 0, sizeof(*term.tabs) * (col - term.col));
-        while (--bp > term.tabs && !*bp) {
+        memset(bp, 0, sizeof(*term->tabs) * (col - term->col));
+        while (--bp > term->tabs && !*bp) {
             /* nothing */ }
-        for (bp += term.tabspaces; bp < term.tabs + col; bp += term.tabspaces) {
+        for (bp += term->tabspaces; bp < term->tabs + col; bp += term->tabspaces) {
             *bp = 1;
         }
     }
     /* update terminal size */
-    term.col = col;
-    term.row = row;
+    term->col = col;
+    term->row = row;
     /* reset scrolling region */
-    tsetscroll(0, row - 1);
+    tsetscroll(term, 0, row - 1);
     /* make use of the LIMIT in tmoveto */
-    tmoveto(term.c.x, term.c.y);
+    tmoveto(term, term->c.x, term->c.y);
     /* Clearing both screens */
-    orig = term.line;
+    orig = term->line;
     do {
         if (mincol < col && 0 < minrow) {
-            tclearregion(mincol, 0, col - 1, minrow - 1);
+            tclearregion(term, mincol, 0, col - 1, minrow - 1);
         }
         if (0 < col && minrow < row) {
-            tclearregion(0, minrow, col - 1, row - 1);
+            tclearregion(term, 0, minrow, col - 1, row - 1);
         }
-        tswapscreen();
-    } while (orig != term.line);
+        tswapscreen(term);
+    } while (orig != term->line);
 
     return (slide > 0);
 }
 
-int libsuckterm_init(unsigned winid, char** opt_cmd, char* shell, char* termname) {
-    cmdfd = ttynew(libsuckterm_get_rows(), libsuckterm_get_cols(), winid, opt_cmd, shell, termname);
-    return cmdfd;
+int libsuckterm_init(Term* term, unsigned winid, char** opt_cmd, char* shell, char* termname) {
+    term->cmdfd = ttynew(term->row, term->col, winid, opt_cmd, shell, termname, &term->pid);
+    if (fcntl(term->cmdfd, F_SETFL, fcntl(term->cmdfd, F_GETFL) | O_NONBLOCK) < 0) {
+        die("fcntl O_NONBLOCK failed: %s\n", SERRNO);
+    }
+    return term->cmdfd;
 }
 
-void libsuckterm_notify_set_size(int col, int row, int cw, int ch) {
-    term.tw = MAX(1, col * cw);
-    term.th = MAX(1, row * ch);
-    tresize(col, row);
-    ttyresize();
+void libsuckterm_notify_set_size(Term* term, int col, int row, int cw, int ch) {
+    term->tw = MAX(1, col * cw);
+    term->th = MAX(1, row * ch);
+    tresize(term, col, row);
+    ttyresize(term);
 }
 
-void libsuckterm_notify_exit(void) {
+void libsuckterm_notify_exit(Term* term) {
     /* Send SIGHUP to shell */
-    kill(child_pid, SIGHUP);
+    if (term->pid > 0) {
+        kill(term->pid, SIGHUP);
+    }
 }
 
-void libsuckterm_notify_focus(bool in) {
-    if (IS_SET(MODE_FOCUS)) {
+void libsuckterm_notify_focus(Term* term, bool in) {
+    if (IS_SET(term, MODE_FOCUS)) {
         if (in) {
-            ttywrite("\033[I", 3);
+            ttywrite(term, "\033[I", 3);
         } else {
-            ttywrite("\033[O", 3);
+            ttywrite(term, "\033[O", 3);
         }
     }
 }
 
-/* button event on startup: 3 = release */
-static int oldbutton = 3;
-void libsuckterm_notify_mouse_event(enum libsuckterm_mouse_event event,
+void libsuckterm_notify_mouse_event(Term* term, enum libsuckterm_mouse_event event,
         int x, int y, unsigned mods, int button_index) {
     char buf[40];
-    static int ox, oy;
     int len;
     unsigned button_code;
 
-    if (!IS_SET(MODE_MOUSE)) {
+    if (!IS_SET(term, MODE_MOUSE)) {
         return;
     }
 
     /* from urxvt */
     if (event == LIBSUCKTERM_MOUSE_MOTION) {
-        if (x == ox && y == oy) {
+        if (x == term->mouseox && y == term->mouseoy) {
             return;
         }
-        if (!IS_SET(MODE_MOUSEMOTION) && !IS_SET(MODE_MOUSEMANY)) {
+        if (!IS_SET(term, MODE_MOUSEMOTION) && !IS_SET(term, MODE_MOUSEMANY)) {
             return;
         }
         /* MOUSE_MOTION: no reporting if no button is pressed */
-        if (IS_SET(MODE_MOUSEMOTION) && oldbutton == 3) {
+        if (IS_SET(term, MODE_MOUSEMOTION) && term->oldbutton == 3) {
             return;
         }
 
-        button_code = oldbutton + 32;
-        ox = x;
-        oy = y;
+        button_code = term->oldbutton + 32;
+        term->mouseox = x;
+        term->mouseoy = y;
     } else {
-        if (!IS_SET(MODE_MOUSESGR) && event == LIBSUCKTERM_MOUSE_RELEASED) {
+        if (!IS_SET(term, MODE_MOUSESGR) && event == LIBSUCKTERM_MOUSE_RELEASED) {
             button_code = 3;
         } else {
             if (button_index >= 3) {
@@ -1520,23 +1738,23 @@ void libsuckterm_notify_mouse_event(enum libsuckterm_mouse_event event,
             }
         }
         if (event == LIBSUCKTERM_MOUSE_PRESSED) {
-            oldbutton = button_code;
-            ox = x;
-            oy = y;
+            term->oldbutton = button_code;
+            term->mouseox = x;
+            term->mouseoy = y;
         } else if (event == LIBSUCKTERM_MOUSE_RELEASED) {
-            oldbutton = 3;
+            term->oldbutton = 3;
             /* MODE_MOUSEX10: no button release reporting */
-            if (IS_SET(MODE_MOUSEX10)) {
+            if (IS_SET(term, MODE_MOUSEX10)) {
                 return;
             }
         }
     }
 
-    if (!IS_SET(MODE_MOUSEX10)) {
+    if (!IS_SET(term, MODE_MOUSEX10)) {
         button_code += mods;
     }
 
-    if (IS_SET(MODE_MOUSESGR)) {
+    if (IS_SET(term, MODE_MOUSESGR)) {
         len = snprintf(buf, sizeof(buf), "\033[<%d;%d;%d%c", button_code, x + 1, y + 1,
                 event == LIBSUCKTERM_MOUSE_RELEASED ? 'm' : 'M');
     } else if (x < 223 && y < 223) {
@@ -1545,5 +1763,266 @@ void libsuckterm_notify_mouse_event(enum libsuckterm_mouse_event event,
         return;
     }
 
-    ttywrite(buf, len);
+    ttywrite(term, buf, len);
+}
+
+/* Calls the libsuckterm_cb_* function for an event */
+static int tcallback(Term* term, int type, int arg, char* str) {
+    switch (type) {
+        case LIBSUCKTERM_EVENT_BELL:
+            libsuckterm_cb_bell(term);
+            break;
+        case LIBSUCKTERM_EVENT_TITLE:
+            if (str) {
+                libsuckterm_cb_set_title(term, str);
+            } else {
+                libsuckterm_cb_reset_title(term);
+            }
+            break;
+        case LIBSUCKTERM_EVENT_RESET_COLORS:
+            libsuckterm_cb_reset_colors(term);
+            break;
+        case LIBSUCKTERM_EVENT_COLOR:
+            return libsuckterm_cb_set_color(term, arg, str);
+        case LIBSUCKTERM_EVENT_CURSOR_VISIBILITY:
+            libsuckterm_cb_set_cursor_visibility(term, arg);
+            break;
+        case LIBSUCKTERM_EVENT_CURSOR_BLINK:
+            libsuckterm_cb_set_cursor_blink(term, arg);
+            break;
+        case LIBSUCKTERM_EVENT_REVERSE_VIDEO:
+            libsuckterm_cb_set_reverse_video(term, arg);
+            break;
+        case LIBSUCKTERM_EVENT_POINTER_MOTION:
+            libsuckterm_cb_set_pointer_motion(term, arg);
+            break;
+    }
+    return 1;
+}
+
+/*
+ * Hands an event to the frontend: through its callback, or appended to the
+ * event queue. The parser never waits for the consumer; when the queue is
+ * full the event is dropped and counted, see LIBSUCKTERM_EVENT_LOST.
+ * Returns 0 if the callback rejected the event.
+ */
+static int temit(Term* term, int type, int arg, char* str) {
+    TermEvent* ev;
+    unsigned tail;
+
+    if (!term->ev) {
+        return tcallback(term, type, arg, str);
+    }
+    tail = term->evtail;
+    if (tail - __atomic_load_n(&term->evhead, __ATOMIC_ACQUIRE) == term->evsize) {
+        __atomic_fetch_add(&term->evlost, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    ev = &term->ev[tail & (term->evsize - 1)];
+    ev->type = type;
+    ev->arg = arg;
+    ev->str = str ? xstrdup(str) : NULL;
+    __atomic_store_n(&term->evtail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Makes the terminal queue its events in a ring of @size entries, rounded
+ * up to a power of two, instead of calling the libsuckterm_cb_* functions
+ * while parsing. One thread may parse while another drains the queue with
+ * libsuckterm_next_event(). Call it before the first input is parsed;
+ * later calls are ignored, as a consumer may be draining the ring.
+ */
+void libsuckterm_event_queue(Term* term, unsigned size) {
+    unsigned n = 1;
+
+    if (term->ev) {
+        return;
+    }
+    while (n < size) {
+        n <<= 1;
+    }
+    term->ev = xmalloc(n * sizeof(*term->ev));
+    term->evsize = n;
+    term->evhead = term->evtail = term->evlost = 0;
+}
+
+/*
+ * Takes the oldest queued event into @ev; returns false if there is none.
+ * Dropped events are reported first, as one LIBSUCKTERM_EVENT_LOST.
+ */
+bool libsuckterm_next_event(Term* term, TermEvent* ev) {
+    unsigned head = term->evhead;
+    unsigned lost;
+
+    if ((lost = __atomic_exchange_n(&term->evlost, 0, __ATOMIC_RELAXED))) {
+        *ev = (TermEvent){ .type = LIBSUCKTERM_EVENT_LOST, .arg = lost };
+        return true;
+    }
+    if (head == __atomic_load_n(&term->evtail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *ev = term->ev[head & (term->evsize - 1)];
+    __atomic_store_n(&term->evhead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Runs the libsuckterm_cb_* functions for all queued events */
+void libsuckterm_dispatch_events(Term* term) {
+    TermEvent ev;
+
+    while (libsuckterm_next_event(term, &ev)) {
+        if (!tcallback(term, ev.type, ev.arg, ev.str)) {
+            fprintf(stderr, "erresc: invalid color %s\n", ev.str);
+        }
+        free(ev.str);
+    }
+}
+
+/* Drops a snapshot no reader holds, and the rows only it shared */
+static void tfreesnap(Snapshot* s) {
+    int y;
+
+    for (y = 0; y < s->rows; y++) {
+        if (--s->row[y]->refs == 0) {
+            free(s->row[y]);
+        }
+    }
+    free(s);
+}
+
+/* Frees the retired snapshots that no reader holds any more */
+static void treclaim(Term* term) {
+    Snapshot** p = &term->retired, * s;
+    int i;
+
+    while ((s = *p)) {
+        for (i = 0; i < SNAP_READERS; i++) {
+            if (__atomic_load_n(&term->hazard[i], __ATOMIC_SEQ_CST) == s) {
+                break;
+            }
+        }
+        if (i < SNAP_READERS) {
+            p = &s->next;
+            continue;
+        }
+        *p = s->next;
+        tfreesnap(s);
+    }
+}
+
+/*
+ * Publishes the screen as it is now for readers on other threads. Only
+ * the rows written since the previous snapshot are copied, into new rows
+ * stamped with this snapshot's version; the others are shared with the
+ * previous snapshot. Call it from the thread that parses, between calls
+ * to ttyparse() or libsuckterm_feed(), at whatever rate readers need.
+ */
+void libsuckterm_publish(Term* term) {
+    Snapshot* old = term->snap, * s;
+    SnapRow* r;
+    int y;
+
+    s = xmalloc(sizeof(*s) + term->row * sizeof(s->row[0]));
+    s->ver = ++term->snapver;
+    s->cols = term->col;
+    s->rows = term->row;
+    s->cx = term->c.x;
+    s->cy = term->c.y;
+    s->mode = term->mode;
+    s->next = NULL;
+    for (y = 0; y < term->row; y++) {
+        if (old && old->cols == term->col && y < old->rows && !term->changed[y]) {
+            r = old->row[y];
+            r->refs++;
+        } else {
+            r = xmalloc(sizeof(*r) + term->col * sizeof(Cell));
+            r->refs = 1;
+            r->ver = s->ver;
+            memcpy(r->cells, term->line[y], term->col * sizeof(Cell));
+        }
+        term->changed[y] = 0;
+        s->row[y] = r;
+    }
+
+    __atomic_store_n(&term->snap, s, __ATOMIC_SEQ_CST);
+    if (old) {
+        old->next = term->retired;
+        term->retired = old;
+    }
+    treclaim(term);
+}
+
+/*
+ * Claims one of the SNAP_READERS reader slots of the terminal, from any
+ * thread. Returns its number, or -1 if all are taken.
+ */
+int libsuckterm_reader_open(Term* term) {
+    unsigned readers = __atomic_load_n(&term->readers, __ATOMIC_RELAXED);
+    int i = 0;
+
+    while (i < SNAP_READERS) {
+        if (readers & 1u << i) {
+            i++;
+        } else if (__atomic_compare_exchange_n(&term->readers, &readers, readers | 1u << i,
+                false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void libsuckterm_reader_close(Term* term, int reader) {
+    __atomic_store_n(&term->hazard[reader], NULL, __ATOMIC_RELEASE);
+    __atomic_fetch_and(&term->readers, ~(1u << reader), __ATOMIC_RELEASE);
+}
+
+/*
+ * Returns the latest snapshot, or NULL before the first one, and keeps it
+ * from being freed until libsuckterm_snapshot_release(): the slot of
+ * @reader is a hazard pointer that libsuckterm_publish() checks before
+ * freeing a snapshot. Neither side ever waits for the other.
+ */
+const Snapshot* libsuckterm_snapshot_acquire(Term* term, int reader) {
+    Snapshot* s;
+
+    do {
+        s = __atomic_load_n(&term->snap, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&term->hazard[reader], s, __ATOMIC_SEQ_CST);
+    } while (s != __atomic_load_n(&term->snap, __ATOMIC_SEQ_CST));
+    return s;
+}
+
+void libsuckterm_snapshot_release(Term* term, int reader) {
+    __atomic_store_n(&term->hazard[reader], NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * Brings @copy, a reader's own copy of the screen, up to date with @s by
+ * copying the rows whose version differs from the one it has. Returns the
+ * number of rows copied. A zeroed ScreenCopy starts empty; its arrays are
+ * the caller's to free().
+ */
+int libsuckterm_snapshot_copy(const Snapshot* s, ScreenCopy* copy) {
+    int y, n = 0;
+
+    if (copy->cols != s->cols || copy->rows != s->rows) {
+        copy->cols = s->cols;
+        copy->rows = s->rows;
+        copy->cells = xrealloc(copy->cells, s->cols * s->rows * sizeof(Cell));
+        copy->ver = xrealloc(copy->ver, s->rows * sizeof(*copy->ver));
+        memset(copy->ver, 0, s->rows * sizeof(*copy->ver));
+    }
+    for (y = 0; y < s->rows; y++) {
+        if (copy->ver[y] == s->row[y]->ver) {
+            continue;
+        }
+        memcpy(copy->cells + y * s->cols, s->row[y]->cells, s->cols * sizeof(Cell));
+        copy->ver[y] = s->row[y]->ver;
+        n++;
+    }
+    copy->cx = s->cx;
+    copy->cy = s->cy;
+    copy->mode = s->mode;
+    return n;
 }
@@ -0,0 +1,55 @@
+#ifndef LIBSUCKTERM_STSERVER_H
+#define LIBSUCKTERM_STSERVER_H
+#include <stdint.h>
+
+/*
+ * Wire protocol of stserver. Every message is a MsgHeader followed by len
+ * bytes of payload. Integers are in host byte order: clients connect over
+ * a unix socket, so both ends run on the same machine.
+ *
+ * A connection starts with MSG_NEW or MSG_ATTACH; the server answers with
+ * MSG_SESSION and then sends the whole screen, followed by updates of the
+ * rows that changed. Sessions outlive their clients, and a session has at
+ * most one client: attaching detaches the previous one.
+ */
+enum msg_type {
+    MSG_NEW,     /* client: MsgSize, start a shell in a new session */
+    MSG_ATTACH,  /* client: uint32_t session id */
+    MSG_INPUT,   /* client: bytes to send to the shell */
+    MSG_RESIZE,  /* client: MsgSize */
+    MSG_SESSION, /* server: uint32_t id of the session attached to */
+    MSG_ROW,     /* server: MsgRow, then MsgRow.cols MsgCell */
+    MSG_CURSOR,  /* server: MsgCursor */
+    MSG_TITLE,   /* server: window title, not terminated */
+    MSG_BELL,    /* server: no payload */
+    MSG_EXIT,    /* server: no payload, the shell has exited */
+};
+
+#define MSG_MAX_LEN (64*1024) /* larger client messages drop the connection */
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;
+} MsgHeader;
+
+/* the server clamps both to 1..1024 */
+typedef struct {
+    uint16_t cols, rows;
+} MsgSize;
+
+typedef struct {
+    uint16_t y, cols;
+} MsgRow;
+
+typedef struct {
+    uint32_t rune; /* unicode code point, 0 for the right half of wide cells */
+    uint32_t mode; /* enum glyph_attribute */
+    uint32_t fg, bg; /* colour index, or TRUECOLOR() */
+} MsgCell;
+
+typedef struct {
+    uint16_t x, y;
+    uint32_t visible;
+} MsgCursor;
+
+#endif
@@ -1,36 +1,56 @@
 #include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
+#include <unistd.h>
 #include <wchar.h>
 #include <X11/cursorfont.h>
 #include <X11/Xft/Xft.h>
 #include <X11/Xutil.h>
+#include <sys/epoll.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <libgen.h>
 #include <X11/Xlib.h>
 #include "helpers.h"
 #include "ptyutils.h"
 #include "libsuckterm.h"
+#include "xshm.h"
+#include "fallback.h"
 #include "arg.h"
 
 /* XEMBED messages */
 #define XEMBED_FOCUS_IN  4
 #define XEMBED_FOCUS_OUT 5
 
+char* argv0;
+static Term* term; /* the terminal of xw */
 static char** opt_cmd = NULL;
 static char* opt_title = NULL;
 static char* opt_embed = NULL;
 static char* opt_class = NULL;
 static char* opt_font = NULL;
+static bool opt_soft = false;
+static bool opt_daemon = false;
+static bool opt_client = false;
+static int ctlfd = -1; /* the daemon's control socket */
 
-void redraw(int timeout);
+void redraw(void);
 void xclear(int x1, int y1, int x2, int y2);
+void xflushfills(void);
+void xdamage(int x, int y, int w, int h);
 void draw(void);
 void drawregion(int x1, int y1, int x2, int y2);
 void xsetsize(int width, int height);
 void xloadcols(void);
 void xseturgent(int add);
+void xhints(void);
 
 static void expose(XEvent*);
 static void visibility(XEvent*);
@@ -54,7 +74,11 @@ enum window_state {
     WIN_FOCUSED = 4
 };
 
-#define REDRAW_TIMEOUT (80*1000) /* 80 ms */
+#define FLASH_TIMEOUT 80           /* ms a reverse video change stays shown */
+#define PARSE_SLICE   256         /* bytes parsed between clock checks */
+#define INPUT_LATENCY (1000*1000) /* 1 ms, in ns */
+#define DAEMON_REQ_SIZ 4096       /* longest request to open a window */
+#define MAX_EVENTS    64          /* epoll events handled per wakeup */
 #define Font Font_
 #define Draw XftDraw *
 #define Colour XftColor
@@ -73,28 +97,100 @@ typedef struct {
     signed char crlf;      /* crlf mode          */
 } Key;
 
+/* The X connection, shared by all windows */
 typedef struct {
     Display* dpy;
     Colormap cmap;
-    Window win;
-    Drawable buf;
     Atom xembed, wmdeletewin;
     XIM xim;
+    Visual* vis;
+    Cursor cursor;
+    int scr;
+} XDisplay;
+
+typedef struct XWindow XWindow;
+typedef struct Fontset Fontset;
+
+/* Per-window timers, run from the event loop */
+enum window_timer {
+    TIMER_FLASH,  /* end of a reverse video flash */
+    TIMER_BLINK,  /* next phase of blinking text */
+    TIMER_CURSOR, /* next phase of the blinking cursor */
+    TIMER_LAST
+};
+
+/* Kinds of fds in the epoll set of run() */
+enum endpoint_kind {
+    EP_X,
+    EP_TIMER,
+    EP_CTL,
+    EP_REQ,
+    EP_PTY,
+    EP_CHILD
+};
+
+/* An fd registered with the epoll set */
+typedef struct {
+    int kind;
+    int fd;
+    uint32_t events; /* currently requested events */
+    XWindow* w; /* NULL for a child that outlived its window */
+    pid_t pid; /* EP_CHILD */
+} Endpoint;
+
+/* A connection to the daemon that has not sent all of its request yet */
+typedef struct {
+    Endpoint ep;
+    size_t len;
+    char* buf;
+} Request;
+
+/* One terminal window */
+struct XWindow {
+    Term* term;
+    Window win;
+    Drawable buf;
     XIC xic;
     Draw draw;
-    Visual* vis;
     XSetWindowAttributes attrs;
-    int scr;
     int tw, th;
     /* tty width and height */
     int w, h;
     /* window width and height */
-    int ch;
-    /* char height */
-    int cw;
-    /* char width  */
     char state; /* focus, redraw, visible */
-} XWindow;
+    bool cursor_visible;
+    bool reverse_video; /* as shown, see xreverse() */
+    bool reverse_want; /* as set by the application */
+    bool cursor_blink; /* att610 */
+    bool blinkoff, cursoroff; /* hidden phase of blinking text and cursor */
+    long long timers[TIMER_LAST]; /* deadlines, 0 when not armed */
+    int oldx, oldy; /* cell the cursor was drawn at */
+    Colour* col; /* dc.col, or a copy once the application changes it */
+    Fontset* fonts;
+    /* Parts of buf painted since the last frame */
+    XRectangle damage[64];
+    int damagelen;
+    char** cmd;
+    char* title;
+    char* class;
+    /* keystrokes held back while the write queue is full, see xsend() */
+    char* held;
+    size_t heldlen, heldsize;
+    char* req; /* daemon request cmd, title and class point into */
+    bool pending; /* changed since the last frame */
+    long long last, syncstart;
+    /* Set by the application since the last frame, see xeffects() */
+    char* newtitle;
+    char** newcol; /* per colour: the name to load, or colreset */
+    bool newcols;
+    bool bell;
+    bool urgent, urgentshown;
+    Endpoint pty, child; /* fd -1 once hung up, or without a pidfd */
+    bool dead; /* closed, freed when settled */
+    bool touched;
+    XWindow* nexttouched;
+    XWindow* next;
+};
 
 /* Font structure */
 typedef struct {
@@ -109,104 +205,207 @@ typedef struct {
     FcPattern* pattern;
 } Font;
 
+/* Font Ring Cache */
+enum {
+    FRC_NORMAL,
+    FRC_ITALIC,
+    FRC_BOLD,
+    FRC_ITALICBOLD
+};
+
+typedef struct {
+    XftFont* font;
+    int flags;
+} Fontcache;
+
+/*
+ * The fonts of one size. Sets stay loaded while a window uses them, and
+ * the FONTSET_CACHE most recently used other ones are kept for zooming
+ * back, along with their fallback fonts and Xft's glyph caches.
+ */
+struct Fontset {
+    int size; /* pixel size */
+    Font font, bfont, ifont, ibfont;
+    int ch;
+    /* char height */
+    int cw;
+    /* char width  */
+    /* Fontcache is an array now. A new font will be appended to the array. */
+    Fontcache frc[16];
+    int frclen;
+    int refs; /* windows using the set */
+    long long used;
+    Fontset* next;
+};
+
+typedef union {
+    int i;
+    unsigned int ui;
+    float f;
+    const void* v;
+} Arg;
+
+typedef struct {
+    uint mod;
+    KeySym keysym;
+    void (* func)(const Arg*);
+    const Arg arg;
+} Shortcut;
+
+static void xzoom(const Arg*);
+static void xzoomreset(const Arg*);
+
 #include "config.h"
 
 /* Drawing Context */
 typedef struct {
     Colour col[LEN(colorname) < 256 ? 256 : LEN(colorname)];
-    Font font, bfont, ifont, ibfont;
     GC gc;
 } DC;
 
-static XWindow xw;
+#define FONTSET_CACHE 4
+
+static XDisplay xd;
 static DC dc;
+static XWindow* windows; /* all windows, most recent first */
+static XWindow* xw; /* the window being handled */
+static XWindow* touched; /* windows to settle after this batch of events */
+static int epfd = -1;
+static Endpoint xep = { .kind = EP_X };
+static int exitstatus = EXIT_SUCCESS; /* of the last shell reaped */
+static Fontset* fontsets; /* all loaded sets */
+static Fontset* fs; /* the fonts of xw */
+static long long fontclock; /* orders fontsets by last use */
+static int defaultfontsize;
+
+void xfreewin(XWindow* w);
+static void xclosewin(XWindow* w);
+static void epadd(Endpoint* ep, uint32_t events);
+static void epset(Endpoint* ep, uint32_t events);
+static Font* xfontvariant(bool italic, bool bold);
+static Fontset* xgetfontset(int size);
+static void xsettimeout(int t, long long ms);
+static void xreverse(void);
+static void xcursorwake(void);
+static void xsettitle(char* p);
+static int xloadcolor(int x, const char* name);
+static void xeffects(void);
+static void xselect(XWindow* w);
+
+static char colreset[] = ""; /* newcol entry for OSC 104 */
+
+/*
+ * The callbacks act on the window of their Term, which need not be the one
+ * selected. The helpers working on xw get it selected for the call.
+ */
+static XWindow* xcbselect(Term* t) {
+    XWindow* old = xw;
+
+    xselect(t->user);
+    return old;
+}
 
-bool cursor_visible = true;
-bool reverse_video = false;
+void libsuckterm_cb_bell(Term* t) {
+    XWindow* w = t->user;
 
-void libsuckterm_cb_bell(void) {
-    if (!(xw.state & WIN_FOCUSED)) {
-        xseturgent(1);
-    }
-    if (bellvolume) {
-        XBell(xw.dpy, bellvolume);
+    if (!(w->state & WIN_FOCUSED)) {
+        w->urgent = true;
     }
+    w->bell = true;
 }
 
-void libsuckterm_cb_set_cursor_visibility(bool visible) {
-    cursor_visible = visible;
+void libsuckterm_cb_set_cursor_visibility(Term* t, bool visible) {
+    XWindow* w = t->user;
+
+    w->cursor_visible = visible;
 }
 
-void libsuckterm_cb_set_reverse_video(bool enable) {
-    bool do_redraw = reverse_video != enable;
+void libsuckterm_cb_set_reverse_video(Term* t, bool enable) {
+    XWindow* old = xcbselect(t);
 
-    reverse_video = enable;
-    if (do_redraw) {
-        redraw(REDRAW_TIMEOUT);
-    }
+    xw->reverse_want = enable;
+    xreverse();
+    xselect(old);
 }
 
-void libsuckterm_cb_set_title(char* p) {
-    XTextProperty prop;
+void libsuckterm_cb_set_cursor_blink(Term* t, bool blink) {
+    XWindow* old = xcbselect(t);
 
-    Xutf8TextListToTextProperty(xw.dpy, &p, 1, XUTF8StringStyle,
-            &prop);
-    XSetWMName(xw.dpy, xw.win, &prop);
-    XFree(prop.value);
+    xw->cursor_blink = blink;
+    xcursorwake();
+    xselect(old);
 }
 
-void libsuckterm_cb_reset_title(void) {
-    libsuckterm_cb_set_title(opt_title ? opt_title : "st");
+void libsuckterm_cb_set_title(Term* t, char* p) {
+    XWindow* w = t->user;
+
+    free(w->newtitle);
+    w->newtitle = xstrdup(p);
 }
 
-void libsuckterm_cb_reset_colors(void) {
-    xloadcols();
+void libsuckterm_cb_reset_title(Term* t) {
+    XWindow* w = t->user;
+
+    libsuckterm_cb_set_title(t, w->title ? w->title : "st");
+}
+
+/* Drops the palette changes of @w not loaded yet */
+static void xdropcolors(XWindow* w) {
+    int x;
+
+    if (!w->newcol) {
+        return;
+    }
+    for (x = 0; x < LEN(dc.col); x++) {
+        if (w->newcol[x] != colreset) {
+            free(w->newcol[x]);
+        }
+    }
+    free(w->newcol);
+    w->newcol = NULL;
+    w->newcols = false;
+}
+
+void libsuckterm_cb_reset_colors(Term* t) {
+    XWindow* w = t->user;
+
+    xdropcolors(w);
+    if (w->col != dc.col) {
+        free(w->col);
+        w->col = dc.col;
+    }
 }
 
-void libsuckterm_cb_set_pointer_motion(int set) {
-    MODBIT(xw.attrs.event_mask, set, PointerMotionMask);
-    XChangeWindowAttributes(xw.dpy, xw.win, CWEventMask, &xw.attrs);
+void libsuckterm_cb_set_pointer_motion(Term* t, int set) {
+    XWindow* w = t->user;
+
+    MODBIT(w->attrs.event_mask, set, PointerMotionMask);
+    XChangeWindowAttributes(xd.dpy, w->win, CWEventMask, &w->attrs);
 }
 
 // XXX: not used?
-void libsuckterm_cb_set_urgency(int add) {
-    xseturgent(add);
+void libsuckterm_cb_set_urgency(Term* t, int add) {
+    XWindow* w = t->user;
+
+    w->urgent = add;
 }
 
 /* DRAWING STUFF */
 
 static char* usedfont = NULL;
-static int usedfontsize = 0;
-
-/* Font Ring Cache */
-enum {
-    FRC_NORMAL,
-    FRC_ITALIC,
-    FRC_BOLD,
-    FRC_ITALICBOLD
-};
-
-typedef struct {
-    XftFont* font;
-    int flags;
-} Fontcache;
-
-/* Fontcache is an array now. A new font will be appended to the array. */
-static Fontcache frc[16];
-static int frclen = 0;
 
 static int x2col(int x) {
     x -= borderpx;
-    x /= xw.cw;
+    x /= fs->cw;
 
-    return LIMIT(x, 0, libsuckterm_get_cols() - 1);
+    return LIMIT(x, 0, libsuckterm_get_cols(term) - 1);
 }
 
 static int y2row(int y) {
     y -= borderpx;
-    y /= xw.ch;
+    y /= fs->ch;
 
-    return LIMIT(y, 0, libsuckterm_get_rows() - 1);
+    return LIMIT(y, 0, libsuckterm_get_rows(term) - 1);
 }
 
 void mousereport(XEvent* e) {
@@ -221,23 +420,34 @@ void mousereport(XEvent* e) {
             | (state & ControlMask ? LIBSUCKTERM_MODIFIER_CONTROL : 0);
 
     if (e->xbutton.type == MotionNotify) {
-        libsuckterm_notify_mouse_event(LIBSUCKTERM_MOUSE_MOTION, x, y, mods, -1);
+        libsuckterm_notify_mouse_event(term, LIBSUCKTERM_MOUSE_MOTION, x, y, mods, -1);
     } else if (e->xbutton.type == ButtonPress) {
-        libsuckterm_notify_mouse_event(LIBSUCKTERM_MOUSE_PRESSED, x, y, mods, button);
+        libsuckterm_notify_mouse_event(term, LIBSUCKTERM_MOUSE_PRESSED, x, y, mods, button);
     } else if (e->xbutton.type == ButtonRelease) {
-        libsuckterm_notify_mouse_event(LIBSUCKTERM_MOUSE_RELEASED, x, y, mods, button);
+        libsuckterm_notify_mouse_event(term, LIBSUCKTERM_MOUSE_RELEASED, x, y, mods, button);
     }
 }
 
 void xresize(int col, int row) {
-    xw.tw = MAX(1, col * xw.cw);
-    xw.th = MAX(1, row * xw.ch);
-
-    XFreePixmap(xw.dpy, xw.buf);
-    xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
-            DefaultDepth(xw.dpy, xw.scr));
-    XftDrawChange(xw.draw, xw.buf);
-    xclear(0, 0, xw.w, xw.h);
+    xw->tw = MAX(1, col * fs->cw);
+    xw->th = MAX(1, row * fs->ch);
+
+    XFreePixmap(xd.dpy, xw->buf);
+    xw->buf = XCreatePixmap(xd.dpy, xw->win, xw->w, xw->h,
+            DefaultDepth(xd.dpy, xd.scr));
+    XftDrawChange(xw->draw, xw->buf);
+    if (opt_soft) {
+        xshm_resize(xw->w, xw->h);
+    }
+    xclear(0, 0, xw->w, xw->h);
+    xflushfills();
+    xdamage(0, 0, xw->w, xw->h);
+    /*
+     * The new pixmap is blank; the next frame repaints all of it, and an
+     * Expose arriving before that frame must redraw rather than copy it.
+     */
+    tfulldirt(term);
+    xw->state |= WIN_REDRAW;
 }
 
 static inline ushort sixd_to_16bit(int x) {
@@ -247,21 +457,13 @@ static inline ushort sixd_to_16bit(int x) {
 void xloadcols(void) {
     int i, r, g, b;
     XRenderColor color = { .alpha = 0xffff };
-    static bool loaded;
-    Colour* cp;
-
-    if (loaded) {
-        for (cp = dc.col; cp < dc.col + LEN(dc.col); ++cp) {
-            XftColorFree(xw.dpy, xw.vis, xw.cmap, cp);
-        }
-    }
 
     /* load colors [0-15] colors and [256-LEN(colorname)[ (config.h) */
     for (i = 0; i < LEN(colorname); i++) {
         if (!colorname[i]) {
             continue;
         }
-        if (!XftColorAllocName(xw.dpy, xw.vis, xw.cmap, colorname[i], &dc.col[i])) {
+        if (!XftColorAllocName(xd.dpy, xd.vis, xd.cmap, colorname[i], &dc.col[i])) {
             die("Could not allocate color '%s'\n", colorname[i]);
         }
     }
@@ -273,7 +475,7 @@ void xloadcols(void) {
                 color.red = sixd_to_16bit(r);
                 color.green = sixd_to_16bit(g);
                 color.blue = sixd_to_16bit(b);
-                if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &dc.col[i])) {
+                if (!XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &color, &dc.col[i])) {
                     die("Could not allocate color %d\n", i);
                 }
                 i++;
@@ -283,19 +485,22 @@ void xloadcols(void) {
 
     for (r = 0; r < 24; r++, i++) {
         color.red = color.green = color.blue = 0x0808 + 0x0a0a * r;
-        if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color,
+        if (!XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &color,
                 &dc.col[i])) {
             die("Could not allocate color %d\n", i);
         }
     }
-    loaded = true;
 }
 
-int libsuckterm_cb_set_color(int x, const char* name) {
+/* Loads colour @x of xw from @name, or its default without one */
+static int xloadcolor(int x, const char* name) {
     XRenderColor color = { .alpha = 0xffff };
     Colour colour;
-    if (x < 0 || x > LEN(colorname)) {
-        return -1;
+
+    /* the palette is shared until a window changes it */
+    if (xw->col == dc.col) {
+        xw->col = xmalloc(sizeof(dc.col));
+        memcpy(xw->col, dc.col, sizeof(dc.col));
     }
     if (!name) {
         if (16 <= x && x < 16 + 216) {
@@ -303,48 +508,173 @@ int libsuckterm_cb_set_color(int x, const char* name) {
             color.red = sixd_to_16bit(r);
             color.green = sixd_to_16bit(g);
             color.blue = sixd_to_16bit(b);
-            if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &colour)) {
+            if (!XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &color, &colour)) {
                 /* something went wrong */
                 return 0;
             }
-            dc.col[x] = colour;
+            xw->col[x] = colour;
             return 1;
         } else if (16 + 216 <= x && x < 256) {
             color.red = color.green = color.blue = 0x0808 + 0x0a0a * (x - (16 + 216));
-            if (!XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &color, &colour)) {
+            if (!XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &color, &colour)) {
                 /* something went wrong */
                 return 0;
             }
-            dc.col[x] = colour;
+            xw->col[x] = colour;
             return 1;
         } else {
             name = colorname[x];
         }
     }
-    if (!XftColorAllocName(xw.dpy, xw.vis, xw.cmap, name, &colour)) {
+    if (!XftColorAllocName(xd.dpy, xd.vis, xd.cmap, name, &colour)) {
         return 0;
     }
-    dc.col[x] = colour;
-    /*
-     * TODO if defaultbg color is changed, borders
-     * are dirty
-     */
-    redraw(0);
+    xw->col[x] = colour;
+    return 1;
+}
+
+/*
+ * Queues a palette change; themes set hundreds of colours at once, so they
+ * are all loaded and drawn at the next frame.
+ */
+int libsuckterm_cb_set_color(Term* t, int x, const char* name) {
+    XWindow* w = t->user;
+
+    if (x < 0 || x >= LEN(dc.col)) {
+        return -1;
+    }
+    if (!w->newcol) {
+        w->newcol = xmalloc(LEN(dc.col) * sizeof(*w->newcol));
+        memset(w->newcol, 0, LEN(dc.col) * sizeof(*w->newcol));
+    }
+    if (w->newcol[x] != colreset) {
+        free(w->newcol[x]);
+    }
+    w->newcol[x] = name ? xstrdup(name) : colreset;
+    w->newcols = true;
     return 1;
 }
 
-void xtermclear(int col1, int row1, int col2, int row2) {
-    XftDrawRect(xw.draw,
-            &dc.col[reverse_video ? defaultfg : defaultbg],
-            borderpx + col1 * xw.cw,
-            borderpx + row1 * xw.ch,
-            (col2 - col1 + 1) * xw.cw,
-            (row2 - row1 + 1) * xw.ch);
+/*
+ * Background and border fills are not sent to the server one by one; they
+ * are collected per colour and submitted with one XRenderFillRectangles
+ * request per colour when the batch is flushed.
+ */
+typedef struct {
+    XRenderColor color;
+    XRectangle* rects;
+    int len, size;
+} Fillbatch;
+
+static Fillbatch fills[16];
+static int fillslen = 0;
+
+void xflushfills(void) {
+    Fillbatch* fb;
+
+    for (fb = fills; fb < fills + fillslen; fb++) {
+        if (opt_soft) {
+            xshm_fillrects(&fb->color, fb->rects, fb->len);
+        } else {
+            XRenderFillRectangles(xd.dpy, PictOpSrc, XftDrawPicture(xw->draw),
+                    &fb->color, fb->rects, fb->len);
+        }
+        fb->len = 0;
+    }
+    fillslen = 0;
+}
+
+void xfillrect(Colour* col, int x, int y, int w, int h) {
+    Fillbatch* fb;
+
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    for (fb = fills; fb < fills + fillslen; fb++) {
+        if (!memcmp(&fb->color, &col->color, sizeof(fb->color))) {
+            break;
+        }
+    }
+    if (fb == fills + LEN(fills)) {
+        xflushfills();
+        fb = fills;
+    }
+    if (fb == fills + fillslen) {
+        fb->color = col->color;
+        fillslen++;
+    }
+
+    if (fb->len == fb->size) {
+        fb->size = fb->size ? fb->size * 2 : 64;
+        fb->rects = xrealloc(fb->rects, fb->size * sizeof(*fb->rects));
+    }
+    fb->rects[fb->len++] = (XRectangle){ x, y, w, h };
+}
+
+/*
+ * Parts of xw->buf painted since the last frame are recorded in xw->damage.
+ * Only these are copied to the window; adjacent rows are merged into one
+ * rectangle as they are added.
+ */
+void xdamage(int x, int y, int w, int h) {
+    XRectangle* r;
+    int x2, y2;
+
+    if (xw->damagelen > 0) {
+        r = &xw->damage[xw->damagelen - 1];
+        if (r->x == x && r->width == w && r->y + r->height == y) {
+            r->height += h;
+            return;
+        }
+    }
+
+    if (xw->damagelen == LEN(xw->damage)) {
+        /* Too scattered; fall back to the bounding box. */
+        x2 = x + w;
+        y2 = y + h;
+        for (r = xw->damage; r < xw->damage + xw->damagelen; r++) {
+            x2 = MAX(x2, r->x + r->width);
+            y2 = MAX(y2, r->y + r->height);
+            x = MIN(x, r->x);
+            y = MIN(y, r->y);
+        }
+        xw->damagelen = 0;
+        w = x2 - x;
+        h = y2 - y;
+    }
+    xw->damage[xw->damagelen++] = (XRectangle){ x, y, w, h };
+}
+
+/*
+ * Copies the damaged parts of xw->buf to the window. The rectangles may
+ * overlap, which a clip list must not, so they are merged into a region.
+ */
+void xpresent(void) {
+    Region clip;
+    int i;
+
+    if (!xw->damagelen) {
+        return;
+    }
+
+    if (opt_soft) {
+        xshm_put(xw->win, dc.gc, xw->damage, xw->damagelen);
+    } else {
+        clip = XCreateRegion();
+        for (i = 0; i < xw->damagelen; i++) {
+            XUnionRectWithRegion(&xw->damage[i], clip, clip);
+        }
+        XSetRegion(xd.dpy, dc.gc, clip);
+        XDestroyRegion(clip);
+        XCopyArea(xd.dpy, xw->buf, xw->win, dc.gc, 0, 0, xw->w, xw->h, 0, 0);
+        XSetClipMask(xd.dpy, dc.gc, None);
+    }
+    xw->damagelen = 0;
 }
 
 void xclear(int x1, int y1, int x2, int y2) {
-    XftDrawRect(xw.draw,
-            &dc.col[reverse_video ? defaultfg : defaultbg],
+    xfillrect(&xw->col[xw->reverse_video ? defaultfg : defaultbg],
             x1, y1, x2 - x1, y2 - y1);
 }
 
@@ -357,37 +687,26 @@ int xloadfontset(Font* f) {
     return 0;
 }
 
-void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
-    int winx = borderpx + x * xw.cw, winy = borderpx + y * xw.ch,
-            width = charlen * xw.cw, xp, i;
-    int frcflags;
-    int u8fl, u8fblen, u8cblen, doesexist;
-    char* u8c, * u8fs;
-    long u8char;
-    Font* font = &dc.font;
-    FcResult fcres;
-    FcPattern* fcpattern, * fontpattern;
-    FcFontSet* fcsets[] = { NULL };
-    FcCharSet* fccharset;
+/* Clip of the glyphs drawn by xdrawstring() */
+static XRectangle drawclip;
+
+void xdrawstring(Colour* fg, XftFont* font, int x, int y, FcChar8* s, int len) {
+    if (opt_soft) {
+        xshm_drawstring(&fg->color, font, x, y, &drawclip, (char*)s, len);
+    } else {
+        XftDrawStringUtf8(xw->draw, fg, font, x, y, s, len);
+    }
+}
+
+/* Resolves the foreground and background colour a Cell is drawn with. */
+void xcellcolors(Cell base, Colour* fgout, Colour* bgout) {
     Colour* fg, * bg, * temp, revfg, revbg, truefg, truebg;
     XRenderColor colfg, colbg;
-    Rectangle r;
-    int oneatatime;
-
-    frcflags = FRC_NORMAL;
 
     if (base.mode & ATTR_ITALIC) {
         if (base.fg == defaultfg) {
             base.fg = defaultitalic;
         }
-        font = &dc.ifont;
-        frcflags = FRC_ITALIC;
-    } else if ((base.mode & ATTR_ITALIC) && (base.mode & ATTR_BOLD)) {
-        if (base.fg == defaultfg) {
-            base.fg = defaultitalic;
-        }
-        font = &dc.ibfont;
-        frcflags = FRC_ITALICBOLD;
     } else if (base.mode & ATTR_UNDERLINE) {
         if (base.fg == defaultfg) {
             base.fg = defaultunderline;
@@ -398,32 +717,32 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
         colfg.red = TRUERED(base.fg);
         colfg.green = TRUEGREEN(base.fg);
         colfg.blue = TRUEBLUE(base.fg);
-        XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
+        XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &colfg, &truefg);
         fg = &truefg;
     } else {
-        fg = &dc.col[base.fg];
+        fg = &xw->col[base.fg];
     }
 
     if (IS_TRUECOL(base.bg)) {
         colbg.green = TRUEGREEN(base.bg);
         colbg.red = TRUERED(base.bg);
         colbg.blue = TRUEBLUE(base.bg);
-        XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
+        XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &colbg, &truebg);
         bg = &truebg;
     } else {
-        bg = &dc.col[base.bg];
+        bg = &xw->col[base.bg];
     }
 
     if (base.mode & ATTR_BOLD) {
         if (BETWEEN(base.fg, 0, 7)) {
             /* basic system colors */
-            fg = &dc.col[base.fg + 8];
+            fg = &xw->col[base.fg + 8];
         } else if (BETWEEN(base.fg, 16, 195)) {
             /* 256 colors */
-            fg = &dc.col[base.fg + 36];
+            fg = &xw->col[base.fg + 36];
         } else if (BETWEEN(base.fg, 232, 251)) {
             /* greyscale */
-            fg = &dc.col[base.fg + 4];
+            fg = &xw->col[base.fg + 4];
         }
         /*
          * Those ranges will not be brightened:
@@ -431,30 +750,28 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
          *    196 - 231 – highest 256 color cube
          *    252 - 255 – brightest colors in greyscale
          */
-        font = &dc.bfont;
-        frcflags = FRC_BOLD;
     }
 
-    if (reverse_video) {
-        if (fg == &dc.col[defaultfg]) {
-            fg = &dc.col[defaultbg];
+    if (xw->reverse_video) {
+        if (fg == &xw->col[defaultfg]) {
+            fg = &xw->col[defaultbg];
         } else {
             colfg.red = ~fg->color.red;
             colfg.green = ~fg->color.green;
             colfg.blue = ~fg->color.blue;
             colfg.alpha = fg->color.alpha;
-            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
+            XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &colfg, &revfg);
             fg = &revfg;
         }
 
-        if (bg == &dc.col[defaultbg]) {
-            bg = &dc.col[defaultfg];
+        if (bg == &xw->col[defaultbg]) {
+            bg = &xw->col[defaultfg];
         } else {
             colbg.red = ~bg->color.red;
             colbg.green = ~bg->color.green;
             colbg.blue = ~bg->color.blue;
             colbg.alpha = bg->color.alpha;
-            XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &revbg);
+            XftColorAllocValue(xd.dpy, xd.vis, xd.cmap, &colbg, &revbg);
             bg = &revbg;
         }
     }
@@ -465,37 +782,86 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
         bg = temp;
     }
 
-#if 0
-	// Reimplement this in X client.
-	if(base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
-		fg = bg;
-#endif
+    if (base.mode & ATTR_BLINK && blinktimeout) {
+        if (!xw->timers[TIMER_BLINK]) {
+            xsettimeout(TIMER_BLINK, blinktimeout);
+        }
+        if (xw->blinkoff) {
+            fg = bg;
+        }
+    }
+
+    *fgout = *fg;
+    *bgout = *bg;
+}
+
+/* Queues the background of a run of Cells, including the adjacent border. */
+void xdrawbg(Cell base, int x, int y, int charlen) {
+    int winx = borderpx + x * fs->cw, winy = borderpx + y * fs->ch,
+            width = charlen * fs->cw;
+    Colour fg, bg;
+
+    xcellcolors(base, &fg, &bg);
 
     /* Intelligent cleaning up of the borders. */
     if (x == 0) {
         xclear(0, (y == 0) ? 0 : winy, borderpx,
-                winy + xw.ch + ((y >= libsuckterm_get_rows() - 1) ? xw.h : 0));
+                winy + fs->ch + ((y >= libsuckterm_get_rows(term) - 1) ? xw->h : 0));
     }
-    if (x + charlen >= libsuckterm_get_cols()) {
-        xclear(winx + width, (y == 0) ? 0 : winy, xw.w,
-                ((y >= libsuckterm_get_rows() - 1) ? xw.h : (winy + xw.ch)));
+    if (x + charlen >= libsuckterm_get_cols(term)) {
+        xclear(winx + width, (y == 0) ? 0 : winy, xw->w,
+                ((y >= libsuckterm_get_rows(term) - 1) ? xw->h : (winy + fs->ch)));
     }
     if (y == 0) {
         xclear(winx, 0, winx + width, borderpx);
     }
-    if (y == libsuckterm_get_rows() - 1) {
-        xclear(winx, winy + xw.ch, winx + width, xw.h);
+    if (y == libsuckterm_get_rows(term) - 1) {
+        xclear(winx, winy + fs->ch, winx + width, xw->h);
     }
 
     /* Clean up the region we want to draw to. */
-    XftDrawRect(xw.draw, bg, winx, winy, width, xw.ch);
+    xfillrect(&bg, winx, winy, width, fs->ch);
+}
+
+/*
+ * Draws the glyphs of a run of Cells over an already painted background.
+ * Underlines are queued as fills; the caller flushes them.
+ */
+void xdrawglyphs(char* s, Cell base, int x, int y, int charlen, int bytelen) {
+    int winx = borderpx + x * fs->cw, winy = borderpx + y * fs->ch,
+            width = charlen * fs->cw, xp, i;
+    int frcflags;
+    int u8fl, u8fblen, u8cblen, doesexist;
+    char* u8c, * u8fs;
+    long u8char;
+    Font* font = &fs->font;
+    FcResult fcres;
+    FcPattern* fcpattern, * fontpattern;
+    FcFontSet* fcsets[] = { NULL };
+    FcCharSet* fccharset;
+    Colour fgcol, bgcol, * fg = &fgcol;
+    int oneatatime;
+
+    frcflags = FRC_NORMAL;
+
+    if ((base.mode & ATTR_ITALIC) && (base.mode & ATTR_BOLD)) {
+        font = xfontvariant(true, true);
+        frcflags = FRC_ITALICBOLD;
+    } else if (base.mode & ATTR_ITALIC) {
+        font = xfontvariant(true, false);
+        frcflags = FRC_ITALIC;
+    } else if (base.mode & ATTR_BOLD) {
+        font = xfontvariant(false, true);
+        frcflags = FRC_BOLD;
+    }
+
+    xcellcolors(base, &fgcol, &bgcol);
 
     /* Set the clip region because Xft is sometimes dirty. */
-    r.x = 0;
-    r.y = 0;
-    r.height = xw.ch;
-    r.width = width;
-    XftDrawSetClipRectangles(xw.draw, winx, winy, &r, 1);
+    drawclip = (XRectangle){ winx, winy, width, fs->ch };
+    if (!opt_soft) {
+        XftDrawSetClipRectangles(xw->draw, 0, 0, &drawclip, 1);
+    }
 
     for (xp = winx; bytelen > 0;) {
         /*
@@ -507,14 +873,14 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
         u8fs = s;
         u8fblen = 0;
         u8fl = 0;
-        oneatatime = font->width != xw.cw;
+        oneatatime = font->width != fs->cw;
         for (; ;) {
             u8c = s;
             u8cblen = utf8decode(s, &u8char);
             s += u8cblen;
             bytelen -= u8cblen;
 
-            doesexist = XftCharExists(xw.dpy, font->match, u8char);
+            doesexist = XftCharExists(xd.dpy, font->match, u8char);
             if (oneatatime || !doesexist || bytelen <= 0) {
                 if (oneatatime || bytelen <= 0) {
                     if (doesexist) {
@@ -524,9 +890,9 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
                 }
 
                 if (u8fl > 0) {
-                    XftDrawStringUtf8(xw.draw, fg, font->match,
+                    xdrawstring(fg, font->match,
                             xp, winy + font->ascent, (FcChar8*)u8fs, u8fblen);
-                    xp += xw.cw * u8fl;
+                    xp += fs->cw * u8fl;
 
                 }
                 break;
@@ -543,19 +909,14 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
         }
 
         /* Search the font cache. */
-        for (i = 0; i < frclen; i++) {
-            if (XftCharExists(xw.dpy, frc[i].font, u8char) && frc[i].flags == frcflags) {
+        for (i = 0; i < fs->frclen; i++) {
+            if (XftCharExists(xd.dpy, fs->frc[i].font, u8char) && fs->frc[i].flags == frcflags) {
                 break;
             }
         }
 
         /* Nothing was found. */
-        if (i >= frclen) {
-            if (!font->set) {
-                xloadfontset(font);
-            }
-            fcsets[0] = font->set;
-
+        if (i >= fs->frclen) {
             /*
              * Nothing was found in the cache. Now use
              * some dozen of Fontconfig calls to get the
@@ -571,165 +932,215 @@ void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
             FcConfigSubstitute(0, fcpattern, FcMatchPattern);
             FcDefaultSubstitute(fcpattern);
 
-            fontpattern = FcFontSetMatch(0, fcsets, FcTrue, fcpattern, &fcres);
+            /* unless an earlier st found the font already */
+            if (!(fontpattern = fallback_match(fcpattern, u8char, frcflags))) {
+                if (!font->set) {
+                    xloadfontset(font);
+                }
+                fcsets[0] = font->set;
+                fontpattern = FcFontSetMatch(0, fcsets, FcTrue, fcpattern, &fcres);
+                fallback_add(u8char, frcflags, fontpattern);
+            }
 
             /*
              * Overwrite or create the new cache entry.
              */
-            if (frclen >= LEN(frc)) {
-                frclen = LEN(frc) - 1;
-                XftFontClose(xw.dpy, frc[frclen].font);
+            if (fs->frclen >= LEN(fs->frc)) {
+                fs->frclen = LEN(fs->frc) - 1;
+                if (opt_soft) {
+                    xshm_forgetfont(fs->frc[fs->frclen].font);
+                }
+                XftFontClose(xd.dpy, fs->frc[fs->frclen].font);
             }
 
-            frc[frclen].font = XftFontOpenPattern(xw.dpy, fontpattern);
-            frc[frclen].flags = frcflags;
+            fs->frc[fs->frclen].font = XftFontOpenPattern(xd.dpy, fontpattern);
+            fs->frc[fs->frclen].flags = frcflags;
 
-            i = frclen;
-            frclen++;
+            i = fs->frclen;
+            fs->frclen++;
 
             FcPatternDestroy(fcpattern);
             FcCharSetDestroy(fccharset);
         }
 
-        XftDrawStringUtf8(xw.draw, fg, frc[i].font,
-                xp, winy + frc[i].font->ascent, (FcChar8*)u8c, u8cblen);
+        xdrawstring(fg, fs->frc[i].font,
+                xp, winy + fs->frc[i].font->ascent, (FcChar8*)u8c, u8cblen);
 
-        xp += xw.cw * wcwidth(u8char);
+        xp += fs->cw * wcwidth(u8char);
     }
 
     /*
-    XftDrawStringUtf8(xw.draw, fg, font->set, winx,
+    XftDrawStringUtf8(xw->draw, fg, font->set, winx,
             winy + font->ascent, (FcChar8 *)s, bytelen);
     */
 
     if (base.mode & ATTR_UNDERLINE) {
-        XftDrawRect(xw.draw, fg, winx, winy + font->ascent + 1, width, 1);
+        xfillrect(fg, winx, winy + font->ascent + 1, width, 1);
     }
 
     /* Reset clip to none. */
-    XftDrawSetClip(xw.draw, 0);
+    if (!opt_soft) {
+        XftDrawSetClip(xw->draw, 0);
+    }
+}
+
+void xdraws(char* s, Cell base, int x, int y, int charlen, int bytelen) {
+    xdrawbg(base, x, y, charlen);
+    xflushfills();
+    xdrawglyphs(s, base, x, y, charlen, bytelen);
+    xflushfills();
 }
 
 void xdrawcursor(void) {
-    static int oldx = 0, oldy = 0;
+    int oldx = xw->oldx, oldy = xw->oldy;
     int sl, width, curx;
     Cell g = { { ' ' }, ATTR_NULL, defaultbg, defaultcs };
 
-    LIMIT(oldx, 0, libsuckterm_get_cols() - 1);
-    LIMIT(oldy, 0, libsuckterm_get_rows() - 1);
+    LIMIT(oldx, 0, libsuckterm_get_cols(term) - 1);
+    LIMIT(oldy, 0, libsuckterm_get_rows(term) - 1);
 
-    curx = libsuckterm_get_cursor_x();
+    curx = libsuckterm_get_cursor_x(term);
 
     /* adjust position if in dummy */
-    if (term.line[oldy][oldx].mode & ATTR_WDUMMY) {
+    if (term->line[oldy][oldx].mode & ATTR_WDUMMY) {
         oldx--;
     }
-    if (term.line[libsuckterm_get_cursor_y()][curx].mode & ATTR_WDUMMY) {
+    if (term->line[libsuckterm_get_cursor_y(term)][curx].mode & ATTR_WDUMMY) {
         curx--;
     }
 
-    memcpy(g.c, term.line[libsuckterm_get_cursor_y()][libsuckterm_get_cursor_x()].c, UTF_SIZ);
+    memcpy(g.c, term->line[libsuckterm_get_cursor_y(term)][libsuckterm_get_cursor_x(term)].c, UTF_SIZ);
 
     /* remove the old cursor */
-    sl = utf8size(term.line[oldy][oldx].c);
-    width = (term.line[oldy][oldx].mode & ATTR_WIDE) ? 2 : 1;
-    xdraws(term.line[oldy][oldx].c, term.line[oldy][oldx], oldx,
+    xdamage(borderpx + oldx * fs->cw, borderpx + oldy * fs->ch, 2 * fs->cw, fs->ch);
+    sl = utf8size(term->line[oldy][oldx].c);
+    width = (term->line[oldy][oldx].mode & ATTR_WIDE) ? 2 : 1;
+    xdraws(term->line[oldy][oldx].c, term->line[oldy][oldx], oldx,
             oldy, width, sl);
 
     /* draw the new one */
-    if (cursor_visible) {
-        if (xw.state & WIN_FOCUSED) {
-            if (reverse_video) {
+    if (xw->cursor_visible && !xw->cursoroff) {
+        xdamage(borderpx + curx * fs->cw, borderpx + libsuckterm_get_cursor_y(term) * fs->ch,
+                2 * fs->cw, fs->ch);
+        if (xw->state & WIN_FOCUSED) {
+            if (xw->reverse_video) {
                 g.mode |= ATTR_REVERSE;
                 g.fg = defaultcs;
                 g.bg = defaultfg;
             }
 
             sl = utf8size(g.c);
-            width = (term.line[libsuckterm_get_cursor_y()][curx].mode & ATTR_WIDE) ? 2 : 1;
-            xdraws(g.c, g, libsuckterm_get_cursor_x(), libsuckterm_get_cursor_y(), width, sl);
+            width = (term->line[libsuckterm_get_cursor_y(term)][curx].mode & ATTR_WIDE) ? 2 : 1;
+            xdraws(g.c, g, libsuckterm_get_cursor_x(term), libsuckterm_get_cursor_y(term), width, sl);
         } else {
-            XftDrawRect(xw.draw, &dc.col[defaultcs],
-                    borderpx + curx * xw.cw,
-                    borderpx + libsuckterm_get_cursor_y() * xw.ch,
-                    xw.cw - 1, 1);
-            XftDrawRect(xw.draw, &dc.col[defaultcs],
-                    borderpx + curx * xw.cw,
-                    borderpx + libsuckterm_get_cursor_y() * xw.ch,
-                    1, xw.ch - 1);
-            XftDrawRect(xw.draw, &dc.col[defaultcs],
-                    borderpx + (curx + 1) * xw.cw - 1,
-                    borderpx + libsuckterm_get_cursor_y() * xw.ch,
-                    1, xw.ch - 1);
-            XftDrawRect(xw.draw, &dc.col[defaultcs],
-                    borderpx + curx * xw.cw,
-                    borderpx + (libsuckterm_get_cursor_y() + 1) * xw.ch - 1,
-                    xw.cw, 1);
-        }
-        oldx = curx, oldy = libsuckterm_get_cursor_y();
-    }
-}
-
-void redraw(int timeout) {
-    struct timespec tv = { 0, timeout * 1000 };
-
-    tfulldirt();
-    draw();
-
-    if (timeout > 0) {
-        nanosleep(&tv, NULL);
-        XSync(xw.dpy, False); /* necessary for a good tput flash */
+            xfillrect(&xw->col[defaultcs],
+                    borderpx + curx * fs->cw,
+                    borderpx + libsuckterm_get_cursor_y(term) * fs->ch,
+                    fs->cw - 1, 1);
+            xfillrect(&xw->col[defaultcs],
+                    borderpx + curx * fs->cw,
+                    borderpx + libsuckterm_get_cursor_y(term) * fs->ch,
+                    1, fs->ch - 1);
+            xfillrect(&xw->col[defaultcs],
+                    borderpx + (curx + 1) * fs->cw - 1,
+                    borderpx + libsuckterm_get_cursor_y(term) * fs->ch,
+                    1, fs->ch - 1);
+            xfillrect(&xw->col[defaultcs],
+                    borderpx + curx * fs->cw,
+                    borderpx + (libsuckterm_get_cursor_y(term) + 1) * fs->ch - 1,
+                    fs->cw, 1);
+            xflushfills();
+        }
+        xw->oldx = curx, xw->oldy = libsuckterm_get_cursor_y(term);
     }
 }
 
+void redraw(void) {
+    tfulldirt(term);
+    draw();
+}
+
 void draw(void) {
-    drawregion(0, 0, libsuckterm_get_cols(), libsuckterm_get_rows());
-    XCopyArea(xw.dpy, xw.buf, xw.win, dc.gc, 0, 0, xw.w, xw.h, 0, 0);
-    XSetForeground(xw.dpy, dc.gc, dc.col[reverse_video ? defaultfg : defaultbg].pixel);
+    xeffects();
+    drawregion(0, 0, libsuckterm_get_cols(term), libsuckterm_get_rows(term));
+    xpresent();
+    XSetForeground(xd.dpy, dc.gc, xw->col[xw->reverse_video ? defaultfg : defaultbg].pixel);
 }
 
-void drawregion(int x1, int y1, int x2, int y2) {
-    int ic, ib, x, y, ox, sl;
+/*
+ * Splits row @y into runs of Cells with equal attributes. Without @glyphs the
+ * backgrounds of the runs are queued, otherwise their glyphs are drawn. Runs
+ * made only of blanks have nothing to draw in the second pass.
+ */
+void xdrawrow(int y, int x1, int x2, bool glyphs) {
+    int ic, ib, x, ox, sl;
+    bool blank;
     Cell base, new;
     char buf[DRAW_BUF_SIZ];
     long u8char;
 
-    if (!(xw.state & WIN_VISIBLE)) {
-        return;
-    }
-
-    for (y = y1; y < y2; y++) {
-        if (!term.dirty[y]) {
-            continue;
-        }
-
-        xtermclear(0, y, libsuckterm_get_cols(), y);
-        term.dirty[y] = 0;
-        base = term.line[y][0];
-        ic = ib = ox = 0;
-        for (x = x1; x < x2; x++) {
-            new = term.line[y][x];
+    base = term->line[y][0];
+    ic = ib = ox = 0;
+    blank = true;
+    for (x = x1; x <= x2; x++) {
+        if (x < x2) {
+            new = term->line[y][x];
             if (new.mode == ATTR_WDUMMY) {
                 continue;
             }
-            if (ib > 0 && (ATTRCMP(base, new) || ib >= DRAW_BUF_SIZ - UTF_SIZ)) {
-                xdraws(buf, base, ox, y, ic, ib);
-                ic = ib = 0;
-            }
-            if (ib == 0) {
-                ox = x;
-                base = new;
+        }
+        if (ib > 0 && (x == x2 || ATTRCMP(base, new) || ib >= DRAW_BUF_SIZ - UTF_SIZ)) {
+            if (!glyphs) {
+                xdrawbg(base, ox, y, ic);
+            } else if (!blank || (base.mode & ATTR_UNDERLINE)) {
+                xdrawglyphs(buf, base, ox, y, ic, ib);
             }
+            ic = ib = 0;
+            blank = true;
+        }
+        if (x == x2) {
+            break;
+        }
+        if (ib == 0) {
+            ox = x;
+            base = new;
+        }
+
+        sl = utf8decode(new.c, &u8char);
+        memcpy(buf + ib, new.c, sl);
+        ib += sl;
+        ic += (new.mode & ATTR_WIDE) ? 2 : 1;
+        blank &= (u8char == ' ');
+    }
+}
 
-            sl = utf8decode(new.c, &u8char);
-            memcpy(buf + ib, new.c, sl);
-            ib += sl;
-            ic += (new.mode & ATTR_WIDE) ? 2 : 1;
+void drawregion(int x1, int y1, int x2, int y2) {
+    int y, winy, rows = libsuckterm_get_rows(term);
+
+    if (!(xw->state & WIN_VISIBLE)) {
+        return;
+    }
+
+    for (y = y1; y < y2; y++) {
+        if (term->dirty[y]) {
+            xdrawrow(y, x1, x2, false);
+
+            /* the row including the border strips next to it */
+            winy = (y == 0) ? 0 : borderpx + y * fs->ch;
+            xdamage(0, winy, xw->w,
+                    ((y >= rows - 1) ? xw->h : borderpx + (y + 1) * fs->ch) - winy);
         }
-        if (ib > 0) {
-            xdraws(buf, base, ox, y, ic, ib);
+    }
+    xflushfills();
+
+    for (y = y1; y < y2; y++) {
+        if (term->dirty[y]) {
+            term->dirty[y] = 0;
+            xdrawrow(y, x1, x2, true);
         }
     }
+    xflushfills();
+
     xdrawcursor();
 }
 
@@ -747,7 +1158,7 @@ int xloadfont(Font* f, FcPattern* pattern) {
         return 1;
     }
 
-    if (!(f->match = XftFontOpenPattern(xw.dpy, match))) {
+    if (!(f->match = XftFontOpenPattern(xd.dpy, match))) {
         FcPatternDestroy(match);
         return 1;
     }
@@ -784,81 +1195,235 @@ void xloadfonts(char* fontstr, int fontsize) {
     if (fontsize > 0) {
         FcPatternDel(pattern, FC_PIXEL_SIZE);
         FcPatternAddDouble(pattern, FC_PIXEL_SIZE, (double)fontsize);
-        usedfontsize = fontsize;
+        fs->size = fontsize;
     } else {
         result = FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &fontval);
         if (result == FcResultMatch) {
-            usedfontsize = (int)fontval;
+            fs->size = (int)fontval;
         } else {
             /*
              * Default font size is 12, if none given. This is to
-             * have a known usedfontsize value.
+             * have a known fs->size value.
              */
             FcPatternAddDouble(pattern, FC_PIXEL_SIZE, 12);
-            usedfontsize = 12;
+            fs->size = 12;
         }
     }
 
     FcConfigSubstitute(0, pattern, FcMatchPattern);
     FcDefaultSubstitute(pattern);
 
-    if (xloadfont(&dc.font, pattern)) {
+    if (xloadfont(&fs->font, pattern)) {
         die("st: can't open font %s\n", fontstr);
     }
 
     /* Setting character width and height. */
-    xw.cw = CEIL(dc.font.width * cwscale);
-    xw.ch = CEIL(dc.font.height * chscale);
+    fs->cw = CEIL(fs->font.width * cwscale);
+    fs->ch = CEIL(fs->font.height * chscale);
 
-    FcPatternDel(pattern, FC_SLANT);
-    FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
-    if (xloadfont(&dc.ifont, pattern)) {
-        die("st: can't open font %s\n", fontstr);
-    }
+    /* the other variants are loaded by xfontvariant() once used */
+    fs->ifont.match = fs->ibfont.match = fs->bfont.match = NULL;
 
-    FcPatternDel(pattern, FC_WEIGHT);
-    FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
-    if (xloadfont(&dc.ibfont, pattern)) {
-        die("st: can't open font %s\n", fontstr);
-    }
+    FcPatternDestroy(pattern);
+}
 
-    FcPatternDel(pattern, FC_SLANT);
-    FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ROMAN);
-    if (xloadfont(&dc.bfont, pattern)) {
-        die("st: can't open font %s\n", fontstr);
+/*
+ * Returns the italic, bold or bold italic variant of the font, loading it
+ * on first use: many sessions never use some of them. If a variant can't
+ * be opened, the regular face stands in for it.
+ */
+Font* xfontvariant(bool italic, bool bold) {
+    Font* f = italic ? (bold ? &fs->ibfont : &fs->ifont) : &fs->bfont;
+    FcPattern* pattern;
+
+    if (f->match) {
+        return f;
     }
 
+    pattern = FcPatternDuplicate(fs->font.pattern);
+    if (italic) {
+        FcPatternDel(pattern, FC_SLANT);
+        FcPatternAddInteger(pattern, FC_SLANT, FC_SLANT_ITALIC);
+    }
+    if (bold) {
+        FcPatternDel(pattern, FC_WEIGHT);
+        FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+    }
+    if (xloadfont(f, pattern)) {
+        fprintf(stderr, "st: can't open %s%s variant of %s\n", italic ? "italic" : "",
+                bold ? (italic ? " bold" : "bold") : "", usedfont);
+        *f = fs->font;
+    }
     FcPatternDestroy(pattern);
+
+    return f;
 }
 
-void xhints(void) {
-    XClassHint class = { opt_class ? opt_class : termname, termname };
-    XWMHints wm = { .flags = InputHint, .input = 1 };
-    XSizeHints* sizeh = NULL;
+static void xfreefont(Font* f) {
+    if (opt_soft) {
+        xshm_forgetfont(f->match);
+    }
+    XftFontClose(xd.dpy, f->match);
+    FcPatternDestroy(f->pattern);
+    if (f->set) {
+        FcFontSetDestroy(f->set);
+    }
+}
 
-    sizeh = XAllocSizeHints();
-    sizeh->flags = PSize | PResizeInc | PBaseSize;
-    sizeh->height = xw.h;
-    sizeh->width = xw.w;
-    sizeh->height_inc = xw.ch;
-    sizeh->width_inc = xw.cw;
+static void xfreefontset(Fontset* f) {
+    Font* variants[] = { &f->ifont, &f->ibfont, &f->bfont };
+    int i;
+
+    for (i = 0; i < LEN(variants); i++) {
+        /* variants that failed to load share the regular face */
+        if (variants[i]->match && variants[i]->match != f->font.match) {
+            xfreefont(variants[i]);
+        }
+    }
+    xfreefont(&f->font);
+    for (i = 0; i < f->frclen; i++) {
+        if (opt_soft) {
+            xshm_forgetfont(f->frc[i].font);
+        }
+        XftFontClose(xd.dpy, f->frc[i].font);
+    }
+    free(f);
+}
+
+/* Returns the set of @size, loading it unless cached; 0 is the size in the font name */
+static Fontset* xgetfontset(int size) {
+    Fontset* f, * cur = fs;
+
+    for (f = fontsets; f && f->size != size; f = f->next);
+    if (!f) {
+        f = xmalloc(sizeof(Fontset));
+        *f = (Fontset){ .next = fontsets };
+        fontsets = f;
+        fs = f;
+        xloadfonts(usedfont, size);
+        fs = cur;
+    }
+    f->used = ++fontclock;
+    return f;
+}
+
+/* Closes the least recently used of the unused sets beyond FONTSET_CACHE */
+static void xprunefontsets(void) {
+    Fontset** p, ** lru, * f;
+    int unused;
+
+    for (;;) {
+        unused = 0;
+        lru = NULL;
+        for (p = &fontsets; *p; p = &(*p)->next) {
+            if ((*p)->refs) {
+                continue;
+            }
+            unused++;
+            if (!lru || (*p)->used < (*lru)->used) {
+                lru = p;
+            }
+        }
+        if (unused <= FONTSET_CACHE) {
+            return;
+        }
+        f = *lru;
+        *lru = f->next;
+        xfreefontset(f);
+    }
+}
+
+/*
+ * Switches xw to the fonts of @size. The window keeps its size and the
+ * terminal is resized once, to what fits in it with the new cells.
+ */
+static void xsetfontsize(int size) {
+    Fontset* f;
+
+    if (size < 1 || size == fs->size) {
+        return;
+    }
+    f = xgetfontset(size);
+    fs->refs--;
+    fs->used = ++fontclock;
+    f->refs++;
+    xw->fonts = fs = f;
+    xprunefontsets();
+
+    xhints();
+    xsetsize(0, 0);
+}
+
+void xzoom(const Arg* arg) {
+    xsetfontsize(fs->size + arg->i);
+}
+
+void xzoomreset(const Arg* arg) {
+    xsetfontsize(defaultfontsize);
+}
+
+void xhints(void) {
+    XClassHint class = { xw->class ? xw->class : termname, termname };
+    XWMHints wm = { .flags = InputHint, .input = 1 };
+    XSizeHints* sizeh = NULL;
+
+    sizeh = XAllocSizeHints();
+    sizeh->flags = PSize | PResizeInc | PBaseSize;
+    sizeh->height = xw->h;
+    sizeh->width = xw->w;
+    sizeh->height_inc = fs->ch;
+    sizeh->width_inc = fs->cw;
     sizeh->base_height = 2 * borderpx;
     sizeh->base_width = 2 * borderpx;
 
-    XSetWMProperties(xw.dpy, xw.win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
+    XSetWMProperties(xd.dpy, xw->win, NULL, NULL, NULL, 0, sizeh, &wm, &class);
     XFree(sizeh);
 }
 
-void xinit(void) {
-    XGCValues gcvalues;
-    Cursor cursor;
-    Window parent;
+static void epadd(Endpoint* ep, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = ep };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        die("epoll_ctl failed: %s\n", SERRNO);
+    }
+    ep->events = events;
+}
 
-    if (!(xw.dpy = XOpenDisplay(NULL))) {
+static void epset(Endpoint* ep, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.ptr = ep };
+
+    if (ep->events == events) {
+        return;
+    }
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0) {
+        die("epoll_ctl failed: %s\n", SERRNO);
+    }
+    ep->events = events;
+}
+
+static void epdel(Endpoint* ep) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ep->fd, NULL);
+    ep->events = 0;
+}
+
+void xopen(void) {
+    if (!(xd.dpy = XOpenDisplay(NULL))) {
         die("Can't open display\n");
     }
-    xw.scr = XDefaultScreen(xw.dpy);
-    xw.vis = XDefaultVisual(xw.dpy, xw.scr);
+    xd.scr = XDefaultScreen(xd.dpy);
+    xd.vis = XDefaultVisual(xd.dpy, xd.scr);
+    xd.cmap = XDefaultColormap(xd.dpy, xd.scr);
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        die("epoll_create1 failed: %s\n", SERRNO);
+    }
+    xep.fd = XConnectionNumber(xd.dpy);
+    epadd(&xep, EPOLLIN);
+}
+
+/* Loads what all windows share: fonts, colours and the GC */
+void xinit(void) {
+    XGCValues gcvalues;
 
     /* font */
     if (!FcInit()) {
@@ -866,75 +1431,205 @@ void xinit(void) {
     }
 
     usedfont = (opt_font == NULL) ? font : opt_font;
-    xloadfonts(usedfont, 0);
+    fallback_open(usedfont);
+    fs = xgetfontset(0);
+    defaultfontsize = fs->size;
 
     /* colors */
-    xw.cmap = XDefaultColormap(xw.dpy, xw.scr);
     xloadcols();
 
-    /* window - default size */
-    xw.h = 2 * borderpx + libsuckterm_get_rows() * xw.ch;
-    xw.w = 2 * borderpx + libsuckterm_get_cols() * xw.cw;
-
-    /* Events */
-    xw.attrs.background_pixel = dc.col[defaultbg].pixel;
-    xw.attrs.border_pixel = dc.col[defaultbg].pixel;
-    xw.attrs.bit_gravity = NorthWestGravity;
-    xw.attrs.event_mask = FocusChangeMask | KeyPressMask
-            | ExposureMask | VisibilityChangeMask | StructureNotifyMask
-            | ButtonMotionMask | ButtonPressMask | ButtonReleaseMask;
-    xw.attrs.colormap = xw.cmap;
-
-    parent = opt_embed ? strtol(opt_embed, NULL, 0) : \
-            XRootWindow(xw.dpy, xw.scr);
-    xw.win = XCreateWindow(xw.dpy, parent, 0, 0,
-            xw.w, xw.h, 0, XDefaultDepth(xw.dpy, xw.scr), InputOutput,
-            xw.vis, CWBackPixel | CWBorderPixel | CWBitGravity
-                    | CWEventMask | CWColormap, &xw.attrs);
-
     memset(&gcvalues, 0, sizeof(gcvalues));
     gcvalues.graphics_exposures = False;
-    dc.gc = XCreateGC(xw.dpy, parent, GCGraphicsExposures,
+    dc.gc = XCreateGC(xd.dpy, XRootWindow(xd.dpy, xd.scr), GCGraphicsExposures,
             &gcvalues);
-    xw.buf = XCreatePixmap(xw.dpy, xw.win, xw.w, xw.h,
-            DefaultDepth(xw.dpy, xw.scr));
-    XSetForeground(xw.dpy, dc.gc, dc.col[defaultbg].pixel);
-    XFillRectangle(xw.dpy, xw.buf, dc.gc, 0, 0, xw.w, xw.h);
-
-    /* Xft rendering context */
-    xw.draw = XftDrawCreate(xw.dpy, xw.buf, xw.vis, xw.cmap);
 
     /* input methods */
-    if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
+    if ((xd.xim = XOpenIM(xd.dpy, NULL, NULL, NULL)) == NULL) {
         XSetLocaleModifiers("@im=local");
-        if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
+        if ((xd.xim = XOpenIM(xd.dpy, NULL, NULL, NULL)) == NULL) {
             XSetLocaleModifiers("@im=");
-            if ((xw.xim = XOpenIM(xw.dpy, NULL, NULL, NULL)) == NULL) {
+            if ((xd.xim = XOpenIM(xd.dpy, NULL, NULL, NULL)) == NULL) {
                 die("XOpenIM failed. Could not open input device.\n");
             }
         }
     }
-    xw.xic = XCreateIC(xw.xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
-            XNClientWindow, xw.win, XNFocusWindow, xw.win, NULL);
-    if (xw.xic == NULL) {
-        die("XCreateIC failed. Could not obtain input method.\n");
-    }
 
     /* white cursor, black outline */
-    cursor = XCreateFontCursor(xw.dpy, XC_xterm);
-    XDefineCursor(xw.dpy, xw.win, cursor);
-    XRecolorCursor(xw.dpy, cursor,
+    xd.cursor = XCreateFontCursor(xd.dpy, XC_xterm);
+    XRecolorCursor(xd.dpy, xd.cursor,
             &(XColor){ .red = 0xffff, .green = 0xffff, .blue = 0xffff },
             &(XColor){ .red = 0x0000, .green = 0x0000, .blue = 0x0000 });
 
-    xw.xembed = XInternAtom(xw.dpy, "_XEMBED", False);
-    xw.wmdeletewin = XInternAtom(xw.dpy, "WM_DELETE_WINDOW", False);
-    XSetWMProtocols(xw.dpy, xw.win, &xw.wmdeletewin, 1);
+    xd.xembed = XInternAtom(xd.dpy, "_XEMBED", False);
+    xd.wmdeletewin = XInternAtom(xd.dpy, "WM_DELETE_WINDOW", False);
+}
+
+static void xselect(XWindow* w) {
+    xw = w;
+    term = w ? w->term : NULL;
+    if (w && w->fonts) {
+        fs = w->fonts;
+    }
+}
+
+static XWindow* xfindwin(Window win) {
+    XWindow* w;
+
+    for (w = windows; w && w->win != win; w = w->next);
+    return w;
+}
+
+/*
+ * Creates an unmapped window for a new terminal and starts @cmd in it, so
+ * that the shell starts up while the window is being set up: this needs
+ * neither fonts nor colours, only the window id for $WINDOWID. The
+ * terminal is resized once the window is mapped; meanwhile its output
+ * stays in the pty.
+ */
+XWindow* xnewwin(char** cmd, char* title, char* class) {
+    XWindow* w = xmalloc(sizeof(XWindow));
+    Window parent;
+
+    *w = (XWindow){
+            .term = tnew(80, 24, defaultfg, defaultbg, tabspaces),
+            .cursor_visible = true,
+            .col = dc.col,
+            .title = title,
+            .class = class,
+            .pending = true,
+            .next = windows,
+    };
+    w->term->user = w;
+    windows = w;
+
+    parent = opt_embed ? strtol(opt_embed, NULL, 0) : \
+            XRootWindow(xd.dpy, xd.scr);
+    w->win = XCreateWindow(xd.dpy, parent, 0, 0, 1, 1, 0,
+            XDefaultDepth(xd.dpy, xd.scr), InputOutput, xd.vis, 0, NULL);
+
+    w->cmd = cmd;
+    libsuckterm_init(w->term, w->win, cmd, shell, termname);
+
+    w->pty = (Endpoint){ .kind = EP_PTY, .fd = w->term->cmdfd, .w = w };
+    epadd(&w->pty, EPOLLIN);
+    w->child = (Endpoint){ .kind = EP_CHILD, .fd = -1, .w = w, .pid = w->term->pid };
+    if (w->child.pid > 0) {
+        if ((w->child.fd = childfd(w->child.pid)) >= 0) {
+            epadd(&w->child, EPOLLIN);
+        } else {
+            /* let the kernel reap; the window closes when the pty hangs up */
+            signal(SIGCHLD, SIG_IGN);
+        }
+    } else if (w->child.pid < 0) {
+        /* as a failed exec did: st exits with a failure once it closes */
+        exitstatus = EXIT_FAILURE;
+    }
+    return w;
+}
+
+/* Sets up a window made by xnewwin() once xinit() has run, and maps it */
+void xshowwin(XWindow* w) {
+    w->fonts = xgetfontset(defaultfontsize);
+    w->fonts->refs++;
+    xselect(w);
+
+    /* window - default size */
+    xw->h = 2 * borderpx + libsuckterm_get_rows(term) * fs->ch;
+    xw->w = 2 * borderpx + libsuckterm_get_cols(term) * fs->cw;
+
+    /* Events */
+    xw->attrs.background_pixel = xw->col[defaultbg].pixel;
+    xw->attrs.border_pixel = xw->col[defaultbg].pixel;
+    xw->attrs.bit_gravity = NorthWestGravity;
+    xw->attrs.event_mask = FocusChangeMask | KeyPressMask
+            | ExposureMask | VisibilityChangeMask | StructureNotifyMask
+            | ButtonMotionMask | ButtonPressMask | ButtonReleaseMask;
+    xw->attrs.colormap = xd.cmap;
+
+    XChangeWindowAttributes(xd.dpy, xw->win, CWBackPixel | CWBorderPixel
+            | CWBitGravity | CWEventMask | CWColormap, &xw->attrs);
+    XResizeWindow(xd.dpy, xw->win, xw->w, xw->h);
+
+    xw->buf = XCreatePixmap(xd.dpy, xw->win, xw->w, xw->h,
+            DefaultDepth(xd.dpy, xd.scr));
+    XSetForeground(xd.dpy, dc.gc, xw->col[defaultbg].pixel);
+    XFillRectangle(xd.dpy, xw->buf, dc.gc, 0, 0, xw->w, xw->h);
+
+    /* Xft rendering context */
+    xw->draw = XftDrawCreate(xd.dpy, xw->buf, xd.vis, xd.cmap);
 
-    libsuckterm_cb_reset_title();
-    XMapWindow(xw.dpy, xw.win);
+    /* software rasterizer */
+    if (opt_soft && xshm_init(xd.dpy, xd.vis, DefaultDepth(xd.dpy, xd.scr), xw->w, xw->h)) {
+        fprintf(stderr, "st: MIT-SHM rendering not available, using Xft\n");
+        opt_soft = false;
+    }
+
+    xw->xic = XCreateIC(xd.xim, XNInputStyle, XIMPreeditNothing | XIMStatusNothing,
+            XNClientWindow, xw->win, XNFocusWindow, xw->win, NULL);
+    if (xw->xic == NULL) {
+        die("XCreateIC failed. Could not obtain input method.\n");
+    }
+
+    XDefineCursor(xd.dpy, xw->win, xd.cursor);
+    XSetWMProtocols(xd.dpy, xw->win, &xd.wmdeletewin, 1);
+
+    xsettitle(xw->title ? xw->title : "st");
+    XMapWindow(xd.dpy, xw->win);
     xhints();
-    XSync(xw.dpy, 0);
+    XFlush(xd.dpy);
+}
+
+/* Destroys @w; unless running as a daemon, st exits with its last window */
+void xfreewin(XWindow* w) {
+    XWindow** p;
+    Endpoint* orphan;
+
+    for (p = &windows; *p != w; p = &(*p)->next);
+    *p = w->next;
+    if (xw == w) {
+        xselect(NULL);
+    }
+
+    if (w->pty.fd >= 0) {
+        epdel(&w->pty);
+    }
+    if (w->child.fd >= 0) {
+        epdel(&w->child);
+        if (childreap(w->child.pid) < 0) {
+            /* still running: reap it once it exits */
+            orphan = xmalloc(sizeof(*orphan));
+            *orphan = w->child;
+            orphan->w = NULL;
+            epadd(orphan, EPOLLIN);
+        } else {
+            close(w->child.fd);
+        }
+    }
+    XDestroyIC(w->xic);
+    XftDrawDestroy(w->draw);
+    XFreePixmap(xd.dpy, w->buf);
+    XDestroyWindow(xd.dpy, w->win);
+    if (w->col != dc.col) {
+        free(w->col);
+    }
+    xdropcolors(w);
+    free(w->newtitle);
+    free(w->held);
+    if (w->fonts) {
+        w->fonts->refs--;
+        w->fonts->used = ++fontclock;
+        xprunefontsets();
+    }
+    tfree(w->term);
+    if (w->req) {
+        free(w->cmd);
+        free(w->req);
+    }
+    free(w);
+
+    if (!windows && !opt_daemon) {
+        exit(exitstatus);
+    }
 }
 
 /* EVENT STUFF */
@@ -994,21 +1689,21 @@ char* kmap(KeySym k, uint state) {
         }
 
         if (kp->appkey > 0) {
-            if (!IS_SET(MODE_APPKEYPAD)) {
+            if (!IS_SET(term, MODE_APPKEYPAD)) {
                 continue;
             }
-        } else if (kp->appkey < 0 && IS_SET(MODE_APPKEYPAD)) {
+        } else if (kp->appkey < 0 && IS_SET(term, MODE_APPKEYPAD)) {
             continue;
         }
 
-        if ((kp->appcursor < 0 && IS_SET(MODE_APPCURSOR)) ||
+        if ((kp->appcursor < 0 && IS_SET(term, MODE_APPCURSOR)) ||
                 (kp->appcursor > 0
-                        && !IS_SET(MODE_APPCURSOR))) {
+                        && !IS_SET(term, MODE_APPCURSOR))) {
             continue;
         }
 
-        if ((kp->crlf < 0 && IS_SET(MODE_CRLF)) ||
-                (kp->crlf > 0 && !IS_SET(MODE_CRLF))) {
+        if ((kp->crlf < 0 && IS_SET(term, MODE_CRLF)) ||
+                (kp->crlf > 0 && !IS_SET(term, MODE_CRLF))) {
             continue;
         }
 
@@ -1018,25 +1713,53 @@ char* kmap(KeySym k, uint state) {
     return NULL;
 }
 
+/*
+ * Sends keyboard input to the child. While the child is not reading and its
+ * write queue is over the high-water mark, the input is held back in order
+ * instead and passed on by xsettle() once the queue drains.
+ */
+static void xsend(char* s, size_t n) {
+    if (!xw->heldlen && !ttyblocked(term)) {
+        ttysend(term, s, n);
+        return;
+    }
+    if (xw->heldlen + n > xw->heldsize) {
+        xw->heldsize = MAX(2 * xw->heldsize, xw->heldlen + n);
+        xw->held = xrealloc(xw->held, xw->heldsize);
+    }
+    memcpy(xw->held + xw->heldlen, s, n);
+    xw->heldlen += n;
+}
+
 void kpress(XEvent* ev) {
     XKeyEvent* e = &ev->xkey;
     KeySym ksym;
     char buf[32];
     char* customkey;
+    Shortcut* bp;
     int len;
     long c;
     Status status;
 
-    if (IS_SET(MODE_KBDLOCK)) {
+    if (IS_SET(term, MODE_KBDLOCK)) {
         return;
     }
+    xcursorwake();
 
-    len = XmbLookupString(xw.xic, e, buf, sizeof buf, &ksym, &status);
+    len = XmbLookupString(xw->xic, e, buf, sizeof buf, &ksym, &status);
     e->state &= ~Mod2Mask;
 
+    /* 1. shortcuts */
+    for (bp = shortcuts; bp < shortcuts + LEN(shortcuts); bp++) {
+        if (ksym == bp->keysym && match(bp->mod, e->state)) {
+            bp->func(&(bp->arg));
+            return;
+        }
+    }
+
     /* 2. custom keys from config.h */
     if ((customkey = kmap(ksym, e->state))) {
-        ttysend(customkey, strlen(customkey));
+        xsend(customkey, strlen(customkey));
         return;
     }
 
@@ -1045,7 +1768,7 @@ void kpress(XEvent* ev) {
         return;
     }
     if (len == 1 && e->state & Mod1Mask) {
-        if (IS_SET(MODE_8BIT)) {
+        if (IS_SET(term, MODE_8BIT)) {
             if (*buf < 0177) {
                 c = *buf | 0x80;
                 len = utf8encode(&c, buf);
@@ -1056,7 +1779,7 @@ void kpress(XEvent* ev) {
             len = 2;
         }
     }
-    ttysend(buf, len);
+    xsend(buf, len);
 }
 
 void cmessage(XEvent* e) {
@@ -1064,21 +1787,24 @@ void cmessage(XEvent* e) {
      * See xembed specs
      *  http://standards.freedesktop.org/xembed-spec/xembed-spec-latest.html
      */
-    if (e->xclient.message_type == xw.xembed && e->xclient.format == 32) {
+    if (e->xclient.message_type == xd.xembed && e->xclient.format == 32) {
         if (e->xclient.data.l[1] == XEMBED_FOCUS_IN) {
-            xw.state |= WIN_FOCUSED;
+            xw->state |= WIN_FOCUSED;
             xseturgent(0);
         } else if (e->xclient.data.l[1] == XEMBED_FOCUS_OUT) {
-            xw.state &= ~WIN_FOCUSED;
+            xw->state &= ~WIN_FOCUSED;
+        }
+        xcursorwake();
+    } else if (e->xclient.data.l[0] == xd.wmdeletewin) {
+        if (term->cmdfd >= 0) {
+            libsuckterm_notify_exit(term);
         }
-    } else if (e->xclient.data.l[0] == xw.wmdeletewin) {
-        libsuckterm_notify_exit();
-        exit(EXIT_SUCCESS);
+        xclosewin(xw);
     }
 }
 
 void resize(XEvent* e) {
-    if (e->xconfigure.width == xw.w && e->xconfigure.height == xw.h) {
+    if (e->xconfigure.width == xw->w && e->xconfigure.height == xw->h) {
         return;
     }
 
@@ -1088,27 +1814,35 @@ void resize(XEvent* e) {
 void expose(XEvent* ev) {
     XExposeEvent* e = &ev->xexpose;
 
-    if (xw.state & WIN_REDRAW) {
+    if (xw->state & WIN_REDRAW) {
         if (!e->count) {
-            xw.state &= ~WIN_REDRAW;
+            xw->state &= ~WIN_REDRAW;
+            redraw();
         }
+        return;
+    }
+
+    /* xw->buf still holds the frame: copy back only what was exposed */
+    xdamage(e->x, e->y, e->width, e->height);
+    if (!e->count) {
+        xpresent();
     }
-    redraw(0);
 }
 
 void visibility(XEvent* ev) {
     XVisibilityEvent* e = &ev->xvisibility;
 
     if (e->state == VisibilityFullyObscured) {
-        xw.state &= ~WIN_VISIBLE;
-    } else if (!(xw.state & WIN_VISIBLE)) {
+        xw->state &= ~WIN_VISIBLE;
+    } else if (!(xw->state & WIN_VISIBLE)) {
         /* need a full redraw for next Expose, not just a buf copy */
-        xw.state |= WIN_VISIBLE | WIN_REDRAW;
+        xw->state |= WIN_VISIBLE | WIN_REDRAW;
+        xcursorwake();
     }
 }
 
 void unmap(XEvent* ev) {
-    xw.state &= ~WIN_VISIBLE;
+    xw->state &= ~WIN_VISIBLE;
 }
 
 void focus(XEvent* ev) {
@@ -1119,15 +1853,16 @@ void focus(XEvent* ev) {
     }
 
     if (ev->type == FocusIn) {
-        XSetICFocus(xw.xic);
-        xw.state |= WIN_FOCUSED;
+        XSetICFocus(xw->xic);
+        xw->state |= WIN_FOCUSED;
         xseturgent(0);
-        libsuckterm_notify_focus(true);
+        libsuckterm_notify_focus(term, true);
     } else {
-        XUnsetICFocus(xw.xic);
-        xw.state &= ~WIN_FOCUSED;
-        libsuckterm_notify_focus(false);
+        XUnsetICFocus(xw->xic);
+        xw->state &= ~WIN_FOCUSED;
+        libsuckterm_notify_focus(term, false);
     }
+    xcursorwake();
 }
 
 void bpress(XEvent* e) {
@@ -1146,118 +1881,637 @@ void xsetsize(int width, int height) {
     int col, row;
 
     if (width != 0) {
-        xw.w = width;
+        xw->w = width;
     }
     if (height != 0) {
-        xw.h = height;
+        xw->h = height;
     }
 
-    col = (xw.w - 2 * borderpx) / xw.cw;
-    row = (xw.h - 2 * borderpx) / xw.ch;
+    col = (xw->w - 2 * borderpx) / fs->cw;
+    row = (xw->h - 2 * borderpx) / fs->ch;
 
-    libsuckterm_notify_set_size(col, row, xw.cw, xw.ch);
+    libsuckterm_notify_set_size(term, col, row, fs->cw, fs->ch);
     xresize(col, row);
 }
 
+/* The urgency hint is updated with the next frame, see xeffects() */
 void xseturgent(int add) {
-    XWMHints* h = XGetWMHints(xw.dpy, xw.win);
+    xw->urgent = add;
+}
 
-    h->flags = add ? (h->flags | XUrgencyHint) : (h->flags & ~XUrgencyHint);
-    XSetWMHints(xw.dpy, xw.win, h);
-    XFree(h);
+static void xsettitle(char* p) {
+    XTextProperty prop;
+
+    Xutf8TextListToTextProperty(xd.dpy, &p, 1, XUTF8StringStyle,
+            &prop);
+    XSetWMName(xd.dpy, xw->win, &prop);
+    XFree(prop.value);
 }
 
-void run(void) {
-    XEvent ev;
-    int w = xw.w, h = xw.h;
-    int term_fd;
-    fd_set rfd;
-    int xfd = XConnectionNumber(xw.dpy), xev, dodraw = 0;
-    struct timeval drawtimeout, * tv = NULL, now, last;
-
-    /* Waiting for window mapping */
-    while (1) {
-        XNextEvent(xw.dpy, &ev);
-        if (ev.type == ConfigureNotify) {
-            w = ev.xconfigure.width;
-            h = ev.xconfigure.height;
-        } else if (ev.type == MapNotify) {
-            break;
+/*
+ * Applies what the application asked for since the last frame. Only the
+ * last title is sent, the palette is loaded in one pass followed by one
+ * full redraw, and any number of bells ring once.
+ */
+static void xeffects(void) {
+    XWMHints* h;
+    char* name;
+    int x;
+
+    if (xw->newtitle) {
+        xsettitle(xw->newtitle);
+        free(xw->newtitle);
+        xw->newtitle = NULL;
+    }
+    if (xw->newcols) {
+        for (x = 0; x < LEN(dc.col); x++) {
+            if (!(name = xw->newcol[x])) {
+                continue;
+            }
+            if (name == colreset) {
+                xloadcolor(x, NULL);
+            } else {
+                if (!xloadcolor(x, name)) {
+                    fprintf(stderr, "erresc: invalid color %s\n", name);
+                }
+                free(name);
+            }
+            xw->newcol[x] = NULL;
         }
+        xw->newcols = false;
+        /*
+         * TODO if defaultbg color is changed, borders
+         * are dirty
+         */
+        tfulldirt(term);
+    }
+    if (xw->urgent != xw->urgentshown) {
+        h = XGetWMHints(xd.dpy, xw->win);
+        h->flags = xw->urgent ? (h->flags | XUrgencyHint) : (h->flags & ~XUrgencyHint);
+        XSetWMHints(xd.dpy, xw->win, h);
+        XFree(h);
+        xw->urgentshown = xw->urgent;
     }
+    if (xw->bell) {
+        if (bellvolume) {
+            XBell(xd.dpy, bellvolume);
+        }
+        xw->bell = false;
+    }
+}
 
-    term_fd = libsuckterm_init(xw.win, opt_cmd, shell, termname);
-    xsetsize(w, h);
+/* Monotonic clock in nanoseconds */
+static long long xnow(void) {
+    struct timespec ts;
 
-    gettimeofday(&last, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    for (xev = actionfps; ;) {
-        FD_ZERO(&rfd);
-        FD_SET(term_fd, &rfd);
-        FD_SET(xfd, &rfd);
+/* Arms the timer @tfd for the absolute time @when; 0 disarms it */
+static void xsettimer(int tfd, long long when) {
+    struct itimerspec its = { .it_value = {
+            .tv_sec = when / 1000000000LL,
+            .tv_nsec = when % 1000000000LL,
+    } };
 
-        if (select(MAX(xfd, term_fd) + 1, &rfd, NULL, NULL, tv) < 0) {
-            if (errno == EINTR) {
-                continue;
+    if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        die("timerfd_settime failed: %s\n", SERRNO);
+    }
+}
+
+/* Arms timer @t of xw to expire in @ms milliseconds */
+static void xsettimeout(int t, long long ms) {
+    xw->timers[t] = xnow() + ms * 1000000LL;
+}
+
+/*
+ * Brings the reverse video shown in line with what the application set.
+ * Each change stays on screen for FLASH_TIMEOUT before the next one, so a
+ * quick on and off, as sent by tput flash, is still seen.
+ */
+static void xreverse(void) {
+    if (xw->timers[TIMER_FLASH] || xw->reverse_video == xw->reverse_want) {
+        return;
+    }
+    xw->reverse_video = xw->reverse_want;
+    tfulldirt(term);
+    xsettimeout(TIMER_FLASH, FLASH_TIMEOUT);
+}
+
+/*
+ * Flips the phase of blinking text and dirties the rows that have some.
+ * The timer is not rearmed once none is left or the window is hidden;
+ * drawing a blinking Cell arms it again.
+ */
+static void xblinktimer(void) {
+    int x, y;
+    bool found = false;
+
+    xw->blinkoff = !xw->blinkoff;
+    for (y = 0; y < libsuckterm_get_rows(term); y++) {
+        for (x = 0; x < libsuckterm_get_cols(term); x++) {
+            if (term->line[y][x].mode & ATTR_BLINK) {
+                term->dirty[y] = 1;
+                found = true;
+                break;
             }
-            die("select failed: %s\n", SERRNO);
         }
-        if (FD_ISSET(term_fd, &rfd)) {
-            ttyread();
+    }
+    if (!found || !(xw->state & WIN_VISIBLE)) {
+        xw->blinkoff = false;
+        return;
+    }
+    xsettimeout(TIMER_BLINK, blinktimeout);
+}
+
+/* Shows the cursor and restarts its blinking, if it blinks */
+static void xcursorwake(void) {
+    xw->cursoroff = false;
+    xw->timers[TIMER_CURSOR] = 0;
+    if (xw->cursor_blink && blinktimeout && (xw->state & WIN_FOCUSED)) {
+        xsettimeout(TIMER_CURSOR, blinktimeout);
+    }
+}
+
+static void xcursortimer(void) {
+    if (!(xw->state & WIN_VISIBLE)) {
+        xw->cursoroff = false;
+        return;
+    }
+    xw->cursoroff = !xw->cursoroff;
+    xsettimeout(TIMER_CURSOR, blinktimeout);
+}
+
+static void (* const timerfns[TIMER_LAST])(void) = {
+        [TIMER_FLASH] = xreverse,
+        [TIMER_BLINK] = xblinktimer,
+        [TIMER_CURSOR] = xcursortimer,
+};
+
+/* Queues @w to be settled at the end of the event batch */
+static void xtouch(XWindow* w) {
+    if (!w->touched) {
+        w->touched = true;
+        w->nexttouched = touched;
+        touched = w;
+    }
+}
+
+/* Closes @w once the current batch of events is handled */
+static void xclosewin(XWindow* w) {
+    w->dead = true;
+    xtouch(w);
+}
+
+/* Hands @ev to the window it is for */
+static void xevent(XEvent* ev) {
+    XWindow* w;
+
+    if (!handler[ev->type] || !(w = xfindwin(ev->xany.window)) || w->dead) {
+        return;
+    }
+    xselect(w);
+    xtouch(w);
+    w->pending = true;
+    (handler[ev->type])(ev);
+}
+
+/*
+ * Parses the buffered pty input in small slices. Whenever parsing has run
+ * for INPUT_LATENCY, keystrokes that arrived meanwhile are dispatched before
+ * the rest, so e.g. ^C reaches the child however much it is printing.
+ */
+static void xparse(void) {
+    XWindow* w = xw;
+    XEvent ev;
+    long long start = xnow();
+
+    while (ttyparse(term, PARSE_SLICE)) {
+        if (xnow() - start < INPUT_LATENCY) {
+            continue;
         }
+        while (XCheckMaskEvent(xd.dpy, KeyPressMask, &ev)) {
+            if (!XFilterEvent(&ev, None)) {
+                xevent(&ev);
+            }
+        }
+        xselect(w);
+        ttyflush(term);
+        start = xnow();
+    }
+    ttyflush(term);
+}
+
+/*
+ * Updates what is polled for @w after a batch of events: its pty is always
+ * read, and written while its write queue is not empty. Keystrokes held
+ * back by xsend() are passed on once the queue has drained.
+ */
+static void xsettle(XWindow* w) {
+    size_t pending;
 
-        if (FD_ISSET(xfd, &rfd)) {
-            xev = actionfps;
+    if (w->dead) {
+        xfreewin(w);
+        return;
+    }
+    if (w->pty.fd < 0) {
+        return;
+    }
+    pending = ttyflush(w->term);
+    if (w->heldlen > 0 && !ttyblocked(w->term)) {
+        ttysend(w->term, w->held, w->heldlen);
+        w->heldlen = 0;
+        pending = ttyflush(w->term);
+    }
+    epset(&w->pty, EPOLLIN | (pending ? EPOLLOUT : 0));
+}
+
+static void ptyevent(XWindow* w, uint32_t events) {
+    xtouch(w);
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        /* writable: flushed when settled */
+        return;
+    }
+    xselect(w);
+    if (ttyread(term) < 0) {
+        /* the shell has gone; with a pidfd, close once it is reaped */
+        epdel(&w->pty);
+        w->pty.fd = -1;
+        if (w->child.fd < 0) {
+            xclosewin(w);
+        }
+        return;
+    }
+    xparse();
+    w->pending = true;
+}
+
+static void childevent(Endpoint* ep) {
+    int status;
+
+    if ((status = childreap(ep->pid)) < 0) {
+        return;
+    }
+    epdel(ep);
+    close(ep->fd);
+    if (!ep->w) {
+        free(ep);
+        return;
+    }
+    ep->fd = -1;
+    ep->w->term->pid = 0; /* nothing left to signal */
+    exitstatus = status;
+    xclosewin(ep->w);
+}
+
+/* Path of the control socket of the daemon on this display */
+static void daemonpath(char* path, size_t size) {
+    char* dir = getenv("XDG_RUNTIME_DIR");
+    char* display = getenv("DISPLAY");
+    char* p;
+
+    if (dir) {
+        snprintf(path, size, "%s/st-%s", dir, display ? display : "");
+        p = path + strlen(dir) + 1;
+    } else {
+        snprintf(path, size, "/tmp/st-%d-%s", (int)getuid(), display ? display : "");
+        p = path + strlen("/tmp/");
+    }
+    for (; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
         }
+    }
+}
+
+static size_t daemonput(char* req, size_t len, const char* s) {
+    size_t n = strlen(s) + 1;
 
-        gettimeofday(&now, NULL);
-        drawtimeout.tv_sec = 0;
-        drawtimeout.tv_usec = (1000 / xfps) * 1000;
-        tv = &drawtimeout;
+    if (len + n > DAEMON_REQ_SIZ) {
+        die("st: command line too long\n");
+    }
+    memcpy(req + len, s, n);
+    return len + n;
+}
 
-        dodraw = 0;
-        if (TIMEDIFF(now, last) > (xev ? (1000 / xfps) : (1000 / actionfps))) {
-            dodraw = 1;
-            last = now;
+/*
+ * Asks the daemon of this display to open the window. A request is the
+ * working directory, the title, the class and the command, each terminated
+ * by a NUL; empty strings stand for the defaults. Returns false if no daemon
+ * is running.
+ */
+static bool daemonrequest(void) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    char req[DAEMON_REQ_SIZ], cwd[PATH_MAX];
+    size_t len = 0, off;
+    ssize_t n;
+    char** arg;
+    int fd;
+
+    daemonpath(sa.sun_path, sizeof(sa.sun_path));
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        die("socket failed: %s\n", SERRNO);
+    }
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    len = daemonput(req, len, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    len = daemonput(req, len, opt_title ? opt_title : "");
+    len = daemonput(req, len, opt_class ? opt_class : "");
+    for (arg = opt_cmd; arg && *arg; arg++) {
+        len = daemonput(req, len, *arg);
+    }
+    for (off = 0; off < len; off += n) {
+        if ((n = write(fd, req + off, len - off)) < 0) {
+            die("st: request to daemon failed: %s\n", SERRNO);
         }
+    }
+    close(fd);
+    return true;
+}
 
-        if (dodraw) {
-            while (XPending(xw.dpy)) {
-                XNextEvent(xw.dpy, &ev);
-                if (XFilterEvent(&ev, None)) {
-                    continue;
+static int daemonlisten(void) {
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    mode_t mask;
+    int fd, probe;
+
+    daemonpath(sa.sun_path, sizeof(sa.sun_path));
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || (probe = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        die("socket failed: %s\n", SERRNO);
+    }
+    if (connect(probe, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
+        die("st: a daemon is already running on %s\n", sa.sun_path);
+    }
+    close(probe);
+
+    /* a stale socket of a daemon that has gone */
+    unlink(sa.sun_path);
+    mask = umask(077);
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        die("st: can't listen on %s: %s\n", sa.sun_path, SERRNO);
+    }
+    umask(mask);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+/* Starts reading the requests of new clients, see daemonrequest() */
+static void daemonaccept(void) {
+    Request* r;
+    int fd;
+
+    while ((fd = accept(ctlfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        r = xmalloc(sizeof(*r));
+        *r = (Request){ .ep = { .kind = EP_REQ, .fd = fd }, .buf = xmalloc(DAEMON_REQ_SIZ) };
+        epadd(&r->ep, EPOLLIN);
+    }
+}
+
+/* Opens the window of a complete request in the directory it names */
+static void daemonopen(char* req, size_t len) {
+    char* cwd, * title, * class, * p;
+    char** cmd = NULL;
+    int nstr = 0, i, here = -1;
+    XWindow* w;
+
+    for (p = req; p < req + len && (p = memchr(p, '\0', req + len - p)); p++) {
+        nstr++;
+    }
+    if (nstr < 3 || req[len - 1] != '\0') {
+        fprintf(stderr, "st: dropping malformed request\n");
+        free(req);
+        return;
+    }
+
+    cwd = req;
+    title = cwd + strlen(cwd) + 1;
+    class = title + strlen(title) + 1;
+    p = class + strlen(class) + 1;
+    if (p < req + len) {
+        cmd = xmalloc((nstr - 2) * sizeof(*cmd));
+        for (i = 0; p < req + len; p += strlen(p) + 1) {
+            cmd[i++] = p;
+        }
+        cmd[i] = NULL;
+    }
+
+    /* the shell is spawned synchronously, so it inherits the directory */
+    if (*cwd) {
+        here = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (chdir(cwd) < 0) {
+            fprintf(stderr, "st: can't change to %s: %s\n", cwd, SERRNO);
+        }
+    }
+    w = xnewwin(cmd, *title ? title : NULL, *class ? class : NULL);
+    if (here >= 0) {
+        if (fchdir(here) < 0) {
+            fprintf(stderr, "st: can't change back: %s\n", SERRNO);
+        }
+        close(here);
+    }
+    w->req = req;
+    xshowwin(w);
+}
+
+/* Reads what a client sent; the request is complete once it hangs up */
+static void daemonread(Request* r) {
+    ssize_t n = 0;
+
+    while (r->len < DAEMON_REQ_SIZ
+            && (n = read(r->ep.fd, r->buf + r->len, DAEMON_REQ_SIZ - r->len)) > 0) {
+        r->len += n;
+    }
+    if (r->len < DAEMON_REQ_SIZ && n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    epdel(&r->ep);
+    close(r->ep.fd);
+    if (r->len < DAEMON_REQ_SIZ && n == 0) {
+        daemonopen(r->buf, r->len);
+    } else {
+        fprintf(stderr, "st: dropping malformed request\n");
+        free(r->buf);
+    }
+    free(r);
+}
+
+void run(void) {
+    struct epoll_event evs[MAX_EVENTS];
+    Endpoint tep = { .kind = EP_TIMER }, ctlep = { .kind = EP_CTL, .fd = ctlfd };
+    Endpoint* ep;
+    XEvent ev;
+    XWindow* w;
+    int n, i;
+    bool drawn;
+    long long now, due, wake, armed = 0;
+    long long frameinterval = 1000000000LL / xfps;
+    uint64_t expirations;
+
+    if ((tep.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        die("timerfd_create failed: %s\n", SERRNO);
+    }
+    epadd(&tep, EPOLLIN);
+    if (ctlfd >= 0) {
+        epadd(&ctlep, EPOLLIN);
+    }
+
+    /*
+     * A window gets a frame as soon as something in it changed and its
+     * previous frame is at least one refresh interval old. Output arriving
+     * earlier arms the timer for that point; while a pty keeps delivering
+     * data it is read without sleeping, so a flood is drawn once per
+     * interval. During a synchronized update nothing is drawn until the
+     * application ends it or synctimeout expires.
+     *
+     * Writes to a pty are queued and flushed when it is writable. The pty
+     * and X are read however full the queue is, as a child that does not
+     * read its input must not hang the windows: above the high-water mark
+     * keystrokes are held back per window instead, see xsend(), and the
+     * emulator drops replies past a cap. The epoll interest of a window
+     * only changes when it is settled after a batch of events it took part
+     * in, so idle windows cost nothing.
+     *
+     * The same timer wakes the loop for the earliest armed window timer
+     * (flash, blinking text and cursor). Its handler runs here and the
+     * window gets a frame; with no timer armed and nothing pending, the
+     * loop sleeps until there is input.
+     */
+    for (;;) {
+        /* Xlib may have queued events while waiting for a reply */
+        n = epoll_wait(epfd, evs, LEN(evs), XQLength(xd.dpy) ? 0 : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("epoll_wait failed: %s\n", SERRNO);
+        }
+        for (i = 0; i < n; i++) {
+            ep = evs[i].data.ptr;
+            switch (ep->kind) {
+                case EP_TIMER:
+                    if (read(ep->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                        die("timerfd read failed: %s\n", SERRNO);
+                    }
+                    armed = 0;
+                    break;
+                case EP_CTL:
+                    daemonaccept();
+                    break;
+                case EP_REQ:
+                    daemonread((Request*)ep);
+                    break;
+                case EP_PTY:
+                    /* may have been closed earlier in this batch */
+                    if (!ep->w->dead) {
+                        ptyevent(ep->w, evs[i].events);
+                    }
+                    break;
+                case EP_CHILD:
+                    childevent(ep);
+                    break;
+            }
+        }
+
+        while (XPending(xd.dpy)) {
+            XNextEvent(xd.dpy, &ev);
+            if (XFilterEvent(&ev, None)) {
+                continue;
+            }
+            if (ev.type >= LASTEvent) {
+                if (opt_soft) {
+                    xshm_event(&ev);
                 }
-                if (handler[ev.type]) {
-                    (handler[ev.type])(&ev);
+            } else {
+                xevent(&ev);
+            }
+        }
+        while ((w = touched)) {
+            touched = w->nexttouched;
+            w->touched = false;
+            xsettle(w);
+        }
+
+        now = xnow();
+        for (w = windows; w; w = w->next) {
+            for (i = 0; i < TIMER_LAST; i++) {
+                if (w->timers[i] && w->timers[i] <= now) {
+                    w->timers[i] = 0;
+                    xselect(w);
+                    timerfns[i]();
+                    w->pending = true;
                 }
             }
+        }
+
+        wake = 0;
+        drawn = false;
+        for (w = windows; w; w = w->next) {
+            if (!w->pending) {
+                continue;
+            }
+            if (!IS_SET(w->term, MODE_SYNC)) {
+                w->syncstart = 0;
+            } else if (!w->syncstart) {
+                w->syncstart = now;
+            }
 
-            draw();
-            XFlush(xw.dpy);
+            due = w->last + frameinterval;
+            if (w->syncstart) {
+                due = MAX(due, w->syncstart + synctimeout * 1000000LL);
+            }
 
-            if (xev && !FD_ISSET(xfd, &rfd)) {
-                xev--;
+            if (now >= due) {
+                xselect(w);
+                draw();
+                w->last = now;
+                w->pending = false;
+                drawn = true;
+            } else if (!wake || due < wake) {
+                wake = due;
             }
-            if (!FD_ISSET(term_fd, &rfd) && !FD_ISSET(xfd, &rfd)) {
-                tv = NULL;
+        }
+        if (drawn) {
+            XFlush(xd.dpy);
+        }
+        for (w = windows; w; w = w->next) {
+            for (i = 0; i < TIMER_LAST; i++) {
+                if (w->timers[i] && (!wake || w->timers[i] < wake)) {
+                    wake = w->timers[i];
+                }
             }
         }
+        if (wake != armed) {
+            xsettimer(tep.fd, wake);
+            armed = wake;
+        }
     }
 }
 
 void usage(void) {
     die("%s " VERSION " (c) 2010-2013 st engineers\n" \
-    "usage: st [-a] [-v] [-c class] [-f font] [-g geometry] [-o file]" \
+    "usage: st [-a] [-v] [-S] [-d] [-n] [-c class] [-f font] [-g geometry] [-o file]" \
     " [-t title] [-w windowid] [-e command ...]\n", argv0);
 }
 
 int main(int argc, char* argv[]) {
+    XWindow* w;
     char* titles;
 
     ARGBEGIN {
                 case 'c':
                     opt_class = EARGF(usage());
                     break;
+                case 'd':
+                    opt_daemon = true;
+                    break;
                 case 'e':
                     /* eat all remaining arguments */
                     if (argc > 1) {
@@ -1271,6 +2525,12 @@ int main(int argc, char* argv[]) {
                 case 'f':
                     opt_font = EARGF(usage());
                     break;
+                case 'n':
+                    opt_client = true;
+                    break;
+                case 'S':
+                    opt_soft = true;
+                    break;
                 case 't':
                     opt_title = EARGF(usage());
                     break;
@@ -1283,10 +2543,27 @@ int main(int argc, char* argv[]) {
             } ARGEND;
 
     run:
+    if (opt_client && !opt_daemon && daemonrequest()) {
+        return 0;
+    }
+    ttyprefetchuser();
     setlocale(LC_CTYPE, "");
     XSetLocaleModifiers("");
-    tnew(80, 24, defaultfg, defaultbg, tabspaces);
-    xinit();
+    xopen();
+    if (opt_daemon) {
+        /* MIT-SHM rendering keeps one image per process */
+        if (opt_soft) {
+            fprintf(stderr, "st: -S is not supported with -d, using Xft\n");
+            opt_soft = false;
+        }
+        xinit();
+        ctlfd = daemonlisten();
+    } else {
+        /* the shell starts up while fonts and colours are loaded */
+        w = xnewwin(opt_cmd, opt_title, opt_class);
+        xinit();
+        xshowwin(w);
+    }
     run();
 
     return 0;
@@ -0,0 +1,562 @@
+/* See LICENSE for licence details. */
+/*
+ * Software rasterizer. Fills and glyphs are recorded as a list of operations
+ * while a frame is drawn, rasterized into a shared memory XImage by a small
+ * pool of threads and pushed to the window with XShmPutImage, so drawing text
+ * costs no requests besides the final puts.
+ */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include "helpers.h"
+#include "xshm.h"
+
+#define SHM_THREADS    4
+#define SHM_STRIP      16   /* pixel rows a thread rasterizes at a time */
+#define SHM_GLYPHS_MAX 4096 /* cache size after which all glyphs are dropped */
+
+enum shm_op {
+    OP_FILL,
+    OP_GLYPH
+};
+
+typedef struct ShmGlyph {
+    XftFont* font;
+    FT_UInt index;
+    int width, height;
+    int left, top;
+    int advance;
+    uchar* alpha;
+    /* next dropped glyph waiting for the recorded ops to be rasterized */
+    struct ShmGlyph* next;
+} ShmGlyph;
+
+/* One recorded drawing operation, already clipped to the image */
+typedef struct {
+    enum shm_op type;
+    uint32_t pixel;
+    int x, y, w, h;
+    ShmGlyph* glyph;
+    /* top left corner of the glyph bitmap */
+    int gx, gy;
+} Op;
+
+static struct {
+    Display* dpy;
+    Visual* vis;
+    int depth;
+    XImage* img;
+    XShmSegmentInfo seg;
+    int completion;
+    /* the server may still be reading the image */
+    bool busy;
+
+    Op* ops;
+    int opslen, opssize;
+
+    /* open addressing hash of (font, glyph index) */
+    ShmGlyph** glyphs;
+    int glyphslen, glyphssize;
+    /* glyphs dropped from the cache that recorded ops may still use */
+    ShmGlyph* dead;
+
+    pthread_t threads[SHM_THREADS - 1];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    unsigned gen;
+    int running;
+} shm = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .start = PTHREAD_COND_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+};
+
+static int attacherror;
+
+static uint32_t xshm_pixel(const XRenderColor* c) {
+    return (c->red >> 8) << 16 | (c->green >> 8) << 8 | (c->blue >> 8);
+}
+
+/*
+ * Blends @fg over a span of pixels with the given coverage. Red and blue are
+ * blended together in one 32 bit multiply (SWAR), green in another; the loop
+ * has no branches on the common path so the compiler can vectorize it.
+ */
+static void xshm_blendspan(uint32_t* dst, const uchar* alpha, int len, uint32_t fg) {
+    uint32_t a, na, d, rb, g;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        a = alpha[i];
+        a += a >> 7; /* 255 -> 256 so full coverage is exact */
+        na = 256 - a;
+        d = dst[i];
+        rb = ((fg & 0xff00ff) * a + (d & 0xff00ff) * na) >> 8;
+        g = ((fg & 0x00ff00) * a + (d & 0x00ff00) * na) >> 8;
+        dst[i] = (rb & 0xff00ff) | (g & 0x00ff00);
+    }
+}
+
+/* Runs all recorded operations on pixel rows [@y0, @y1) */
+static void xshm_rasterstrip(int y0, int y1) {
+    uint32_t* pixels = (uint32_t*)shm.img->data;
+    int stride = shm.img->bytes_per_line / 4;
+    int x, y, ya, yb;
+    uint32_t* dst;
+    Op* op;
+
+    for (op = shm.ops; op < shm.ops + shm.opslen; op++) {
+        ya = MAX(op->y, y0);
+        yb = MIN(op->y + op->h, y1);
+        for (y = ya; y < yb; y++) {
+            dst = pixels + y * stride + op->x;
+            if (op->type == OP_FILL) {
+                for (x = 0; x < op->w; x++) {
+                    dst[x] = op->pixel;
+                }
+            } else {
+                xshm_blendspan(dst, op->glyph->alpha
+                                + (y - op->gy) * op->glyph->width + (op->x - op->gx),
+                        op->w, op->pixel);
+            }
+        }
+    }
+}
+
+/* Rasterizes every @n-th strip of the image, starting with strip @t */
+static void xshm_rasterband(int t, int n) {
+    int y;
+
+    for (y = t * SHM_STRIP; y < shm.img->height; y += n * SHM_STRIP) {
+        xshm_rasterstrip(y, MIN(y + SHM_STRIP, shm.img->height));
+    }
+}
+
+static void* xshm_worker(void* arg) {
+    int t = (intptr_t)arg;
+    unsigned gen = 0;
+
+    pthread_mutex_lock(&shm.lock);
+    for (;;) {
+        while (shm.gen == gen) {
+            pthread_cond_wait(&shm.start, &shm.lock);
+        }
+        gen = shm.gen;
+        pthread_mutex_unlock(&shm.lock);
+
+        xshm_rasterband(t, shm.nthreads);
+
+        pthread_mutex_lock(&shm.lock);
+        if (--shm.running == 0) {
+            pthread_cond_signal(&shm.done);
+        }
+    }
+    return NULL;
+}
+
+/* Frees the dropped glyphs once no recorded op refers to them */
+static void xshm_freedead(void) {
+    ShmGlyph* g;
+
+    while ((g = shm.dead)) {
+        shm.dead = g->next;
+        free(g->alpha);
+        free(g);
+    }
+}
+
+static void xshm_rasterize(void) {
+    if (shm.nthreads > 1 && shm.opslen > 0) {
+        pthread_mutex_lock(&shm.lock);
+        shm.running = shm.nthreads - 1;
+        shm.gen++;
+        pthread_cond_broadcast(&shm.start);
+        pthread_mutex_unlock(&shm.lock);
+
+        xshm_rasterband(0, shm.nthreads);
+
+        pthread_mutex_lock(&shm.lock);
+        while (shm.running) {
+            pthread_cond_wait(&shm.done, &shm.lock);
+        }
+        pthread_mutex_unlock(&shm.lock);
+    } else {
+        xshm_rasterband(0, 1);
+    }
+    shm.opslen = 0;
+    xshm_freedead();
+}
+
+static Bool xshm_iscompletion(Display* dpy, XEvent* ev, XPointer arg) {
+    return ev->type == shm.completion;
+}
+
+/* Waits until the server is done reading the image of the last put */
+static void xshm_wait(void) {
+    XEvent ev;
+
+    if (shm.busy) {
+        XIfEvent(shm.dpy, &ev, xshm_iscompletion, NULL);
+        shm.busy = false;
+    }
+}
+
+static int xshm_attacherror(Display* dpy, XErrorEvent* e) {
+    attacherror = 1;
+    return 0;
+}
+
+static int xshm_create(int w, int h) {
+    int (* oldhandler)(Display*, XErrorEvent*);
+
+    shm.img = XShmCreateImage(shm.dpy, shm.vis, shm.depth, ZPixmap, NULL,
+            &shm.seg, w, h);
+    if (!shm.img) {
+        return 1;
+    }
+
+    shm.seg.shmid = shmget(IPC_PRIVATE, shm.img->bytes_per_line * shm.img->height,
+            IPC_CREAT | 0600);
+    if (shm.seg.shmid < 0) {
+        XDestroyImage(shm.img);
+        return 1;
+    }
+    shm.seg.shmaddr = shm.img->data = shmat(shm.seg.shmid, NULL, 0);
+    shm.seg.readOnly = False;
+
+    /* Attaching fails asynchronously, e.g. on remote displays. */
+    attacherror = 0;
+    oldhandler = XSetErrorHandler(xshm_attacherror);
+    XShmAttach(shm.dpy, &shm.seg);
+    XSync(shm.dpy, False);
+    XSetErrorHandler(oldhandler);
+    shmctl(shm.seg.shmid, IPC_RMID, NULL);
+
+    if (attacherror) {
+        shmdt(shm.seg.shmaddr);
+        XDestroyImage(shm.img);
+        return 1;
+    }
+    return 0;
+}
+
+static void xshm_destroy(void) {
+    xshm_wait();
+    XShmDetach(shm.dpy, &shm.seg);
+    XDestroyImage(shm.img);
+    shmdt(shm.seg.shmaddr);
+}
+
+int xshm_init(Display* dpy, Visual* vis, int depth, int w, int h) {
+    union { uint32_t i; char c; } order = { 1 };
+    int i;
+
+    if (!XShmQueryExtension(dpy)) {
+        return 1;
+    }
+    /* The rasterizer only writes 8 bit per channel xRGB pixels. */
+    if (vis->class != TrueColor || vis->red_mask != 0xff0000
+            || vis->green_mask != 0xff00 || vis->blue_mask != 0xff) {
+        return 1;
+    }
+
+    shm.dpy = dpy;
+    shm.vis = vis;
+    shm.depth = depth;
+    shm.completion = XShmGetEventBase(dpy) + ShmCompletion;
+    if (xshm_create(w, h)) {
+        return 1;
+    }
+    if (shm.img->bits_per_pixel != 32
+            || shm.img->byte_order != (order.c ? LSBFirst : MSBFirst)) {
+        xshm_destroy();
+        return 1;
+    }
+
+    shm.nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    LIMIT(shm.nthreads, 1, SHM_THREADS);
+    for (i = 1; i < shm.nthreads; i++) {
+        if (pthread_create(&shm.threads[i - 1], NULL, xshm_worker, (void*)(intptr_t)i)) {
+            shm.nthreads = i;
+            break;
+        }
+    }
+    return 0;
+}
+
+void xshm_resize(int w, int h) {
+    if (w == shm.img->width && h == shm.img->height) {
+        return;
+    }
+
+    xshm_destroy();
+    shm.opslen = 0;
+    xshm_freedead();
+    if (xshm_create(w, h)) {
+        die("Could not create shared memory image\n");
+    }
+}
+
+static Op* xshm_newop(enum shm_op type, uint32_t pixel, int x, int y, int w, int h) {
+    Op* op;
+    int x2 = MIN(x + w, shm.img->width), y2 = MIN(y + h, shm.img->height);
+
+    x = MAX(x, 0);
+    y = MAX(y, 0);
+    if (x >= x2 || y >= y2) {
+        return NULL;
+    }
+
+    if (shm.opslen == shm.opssize) {
+        shm.opssize = shm.opssize ? shm.opssize * 2 : 256;
+        shm.ops = xrealloc(shm.ops, shm.opssize * sizeof(*shm.ops));
+    }
+    op = &shm.ops[shm.opslen++];
+    *op = (Op){ .type = type, .pixel = pixel, .x = x, .y = y, .w = x2 - x, .h = y2 - y };
+    return op;
+}
+
+void xshm_fillrects(const XRenderColor* col, const XRectangle* r, int n) {
+    uint32_t pixel = xshm_pixel(col);
+
+    for (; n > 0; r++, n--) {
+        xshm_newop(OP_FILL, pixel, r->x, r->y, r->width, r->height);
+    }
+}
+
+static unsigned xshm_hash(XftFont* font, FT_UInt index) {
+    return ((uintptr_t)font >> 4) * 2654435761u + index;
+}
+
+static void xshm_insertglyph(ShmGlyph* g) {
+    unsigned i, mask = shm.glyphssize - 1;
+
+    for (i = xshm_hash(g->font, g->index) & mask; shm.glyphs[i]; i = (i + 1) & mask) {
+        /* nothing */ }
+    shm.glyphs[i] = g;
+    shm.glyphslen++;
+}
+
+static void xshm_rehash(int size) {
+    ShmGlyph** old = shm.glyphs;
+    int i, oldsize = shm.glyphssize;
+
+    shm.glyphs = calloc(size, sizeof(*shm.glyphs));
+    if (!shm.glyphs) {
+        die("Out of memory\n");
+    }
+    shm.glyphssize = size;
+    shm.glyphslen = 0;
+    for (i = 0; i < oldsize; i++) {
+        if (old[i]) {
+            xshm_insertglyph(old[i]);
+        }
+    }
+    free(old);
+}
+
+static ShmGlyph* xshm_loadglyph(XftFont* font, FT_UInt index) {
+    FcBool antialias = FcTrue, autohint = FcFalse, hinting = FcTrue;
+    FT_Int32 flags = FT_LOAD_RENDER;
+    FT_Bitmap* bm;
+    FT_Face face;
+    ShmGlyph* g;
+    uchar* row;
+    int x, y;
+
+    FcPatternGetBool(font->pattern, FC_ANTIALIAS, 0, &antialias);
+    FcPatternGetBool(font->pattern, FC_AUTOHINT, 0, &autohint);
+    FcPatternGetBool(font->pattern, FC_HINTING, 0, &hinting);
+    if (!antialias) {
+        flags |= FT_LOAD_TARGET_MONO;
+    }
+    if (autohint) {
+        flags |= FT_LOAD_FORCE_AUTOHINT;
+    }
+    if (!hinting) {
+        flags |= FT_LOAD_NO_HINTING;
+    }
+
+    if (!(face = XftLockFace(font))) {
+        return NULL;
+    }
+    if (FT_Load_Glyph(face, index, flags)) {
+        XftUnlockFace(font);
+        return NULL;
+    }
+
+    bm = &face->glyph->bitmap;
+    g = xmalloc(sizeof(*g));
+    g->font = font;
+    g->index = index;
+    g->width = bm->width;
+    g->height = bm->rows;
+    g->left = face->glyph->bitmap_left;
+    g->top = face->glyph->bitmap_top;
+    g->advance = (face->glyph->advance.x + 32) >> 6;
+    g->alpha = xmalloc(MAX(1, g->width * g->height));
+
+    for (y = 0; y < g->height; y++) {
+        row = bm->buffer + y * bm->pitch;
+        for (x = 0; x < g->width; x++) {
+            if (bm->pixel_mode == FT_PIXEL_MODE_MONO) {
+                g->alpha[y * g->width + x] = (row[x >> 3] & (0x80 >> (x & 7))) ? 0xff : 0;
+            } else if (bm->pixel_mode == FT_PIXEL_MODE_GRAY) {
+                g->alpha[y * g->width + x] = row[x];
+            } else {
+                g->alpha[y * g->width + x] = 0;
+            }
+        }
+    }
+    XftUnlockFace(font);
+
+    return g;
+}
+
+static ShmGlyph* xshm_getglyph(XftFont* font, FT_UInt index) {
+    unsigned i, mask;
+    ShmGlyph* g;
+
+    if (shm.glyphssize) {
+        mask = shm.glyphssize - 1;
+        for (i = xshm_hash(font, index) & mask; (g = shm.glyphs[i]); i = (i + 1) & mask) {
+            if (g->font == font && g->index == index) {
+                return g;
+            }
+        }
+    }
+
+    if (!(g = xshm_loadglyph(font, index))) {
+        return NULL;
+    }
+    if (2 * (shm.glyphslen + 1) > shm.glyphssize) {
+        xshm_rehash(shm.glyphssize ? 2 * shm.glyphssize : 256);
+    }
+    xshm_insertglyph(g);
+
+    return g;
+}
+
+static void xshm_dropglyphs(XftFont* font) {
+    ShmGlyph** old = shm.glyphs;
+    int i, oldsize = shm.glyphssize;
+
+    shm.glyphs = NULL;
+    shm.glyphssize = 0;
+    xshm_rehash(MAX(oldsize, 256));
+    for (i = 0; i < oldsize; i++) {
+        if (!old[i]) {
+            continue;
+        }
+        if (font && old[i]->font != font) {
+            xshm_insertglyph(old[i]);
+        } else {
+            old[i]->next = shm.dead;
+            shm.dead = old[i];
+        }
+    }
+    free(old);
+    if (!shm.opslen) {
+        xshm_freedead();
+    }
+}
+
+void xshm_drawstring(const XRenderColor* fg, XftFont* font, int x, int y,
+        const XRectangle* clip, const char* s, int len) {
+    uint32_t pixel = xshm_pixel(fg);
+    int n, x1, y1, x2, y2;
+    long u8char;
+    ShmGlyph* g;
+    Op* op;
+
+    for (; len > 0; s += n, len -= n) {
+        n = utf8decode((char*)s, &u8char);
+        if (!(g = xshm_getglyph(font, XftCharIndex(shm.dpy, font, u8char)))) {
+            continue;
+        }
+
+        x1 = MAX(x + g->left, clip->x);
+        y1 = MAX(y - g->top, clip->y);
+        x2 = MIN(x + g->left + g->width, clip->x + clip->width);
+        y2 = MIN(y - g->top + g->height, clip->y + clip->height);
+        if (x1 < x2 && y1 < y2
+                && (op = xshm_newop(OP_GLYPH, pixel, x1, y1, x2 - x1, y2 - y1))) {
+            op->glyph = g;
+            op->gx = x + g->left;
+            op->gy = y - g->top;
+        }
+        x += g->advance;
+    }
+}
+
+/*
+ * Must be called before an XftFont the rasterizer has seen is closed. Its
+ * glyphs leave the cache at once but ops recorded earlier in the frame keep
+ * using them until the frame is rasterized.
+ */
+void xshm_forgetfont(XftFont* font) {
+    if (shm.glyphssize) {
+        xshm_dropglyphs(font);
+    }
+}
+
+/* Handles the completion events of the puts; returns if @ev was one */
+int xshm_event(XEvent* ev) {
+    if (ev->type != shm.completion) {
+        return 0;
+    }
+    shm.busy = false;
+    return 1;
+}
+
+/* Clips @r to the image; returns if anything is left of it */
+static int xshm_cliprect(const XRectangle* r, XRectangle* out) {
+    int x = MAX(r->x, 0), y = MAX(r->y, 0);
+    int x2 = MIN(r->x + r->width, shm.img->width);
+    int y2 = MIN(r->y + r->height, shm.img->height);
+
+    if (x >= x2 || y >= y2) {
+        return 0;
+    }
+    *out = (XRectangle){ x, y, x2 - x, y2 - y };
+    return 1;
+}
+
+/*
+ * Puts the damaged rectangles. The server handles the puts in order, so only
+ * the last one asks for the completion event that xshm_wait() waits for.
+ */
+void xshm_put(Drawable d, GC gc, const XRectangle* r, int n) {
+    XRectangle c, next;
+    int i, have = 0;
+
+    xshm_wait();
+    xshm_rasterize();
+
+    for (i = 0; i < n; i++) {
+        if (!xshm_cliprect(&r[i], &next)) {
+            continue;
+        }
+        if (have) {
+            XShmPutImage(shm.dpy, d, gc, shm.img, c.x, c.y, c.x, c.y, c.width, c.height, False);
+        }
+        c = next;
+        have = 1;
+    }
+    if (have) {
+        XShmPutImage(shm.dpy, d, gc, shm.img, c.x, c.y, c.x, c.y, c.width, c.height, True);
+        shm.busy = true;
+    }
+
+    if (shm.glyphslen > SHM_GLYPHS_MAX) {
+        xshm_dropglyphs(NULL);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef LIBSUCKTERM_XSHM_H
+#define LIBSUCKTERM_XSHM_H
+#include <X11/Xlib.h>
+#include <X11/Xft/Xft.h>
+
+int xshm_init(Display* dpy, Visual* vis, int depth, int w, int h);
+void xshm_resize(int w, int h);
+void xshm_fillrects(const XRenderColor* col, const XRectangle* r, int n);
+void xshm_drawstring(const XRenderColor* fg, XftFont* font, int x, int y,
+        const XRectangle* clip, const char* s, int len);
+void xshm_forgetfont(XftFont* font);
+int xshm_event(XEvent* ev);
+void xshm_put(Drawable d, GC gc, const XRectangle* r, int n);
+
+#endif